@@ -0,0 +1,100 @@
+#include "arena.h"
+#include <stddef.h>
+#include <stdlib.h>
+
+/* Size of the first chunk. Chunks grow as the arena does. */
+#define CHUNK_SIZE 4096
+
+#define ALIGN (sizeof(max_align_t))
+
+struct chunk {
+	struct chunk *next;
+	size_t size, used;
+	max_align_t data[];
+};
+
+struct arena {
+	/* Allocations are made from the first chunk. */
+	struct chunk *chunks;
+};
+
+static int arena(struct arena *a, struct arena **a_out)
+{
+	if(a) goto free;
+
+	a = malloc(sizeof *a);
+	if(!a) goto e_malloc;
+
+	a->chunks = NULL;
+
+	*a_out = a;
+	return 0;
+
+free:
+	while(a->chunks) {
+		struct chunk *c = a->chunks;
+		a->chunks = c->next;
+		free(c);
+	}
+	free(a);
+e_malloc:
+	return -1;
+}
+
+int arena_new(struct arena **a_out)
+{
+	return arena(NULL, a_out);
+}
+
+void arena_free(struct arena *a)
+{
+	if(a) arena(a, NULL);
+}
+
+void *arena_alloc(struct arena *a, unsigned sz)
+{
+	sz = (sz + ALIGN - 1) / ALIGN * ALIGN;
+
+	struct chunk *c = a->chunks;
+	if(!c || c->size - c->used < sz) {
+		/* Double so that a level needs few chunks. */
+		size_t size = c ? 2 * c->size : CHUNK_SIZE;
+		while(size < sz) size *= 2;
+		c = malloc(sizeof *c + size);
+		if(!c) return NULL;
+		c->size = size;
+		c->used = 0;
+		c->next = a->chunks;
+		a->chunks = c;
+	}
+
+	void *p = (char *)c->data + c->used;
+	c->used += sz;
+	return p;
+}
+
+void arena_reset(struct arena *a)
+{
+	struct chunk *c = a->chunks;
+	if(!c) return;
+	if(!c->next) {
+		c->used = 0;
+		return;
+	}
+
+	/* Replace the chunks with one that fits all of it, so that filling
+	 * the arena the same way again does not allocate. */
+	size_t size = 0;
+	while(a->chunks) {
+		c = a->chunks;
+		a->chunks = c->next;
+		size += c->size;
+		free(c);
+	}
+	c = malloc(sizeof *c + size);
+	if(!c) return;
+	c->size = size;
+	c->used = 0;
+	c->next = NULL;
+	a->chunks = c;
+}
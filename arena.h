@@ -0,0 +1,15 @@
+/*
+ * Bump allocator for things that all die at the same time, like the
+ * objects of a level.
+ */
+
+struct arena;
+
+int arena_new(struct arena **a_out);
+void arena_free(struct arena *a);
+
+/* Memory is aligned for any type and is only released by arena_reset()
+ * or arena_free(). */
+void *arena_alloc(struct arena *a, unsigned sz);
+/* Release everything allocated. The memory is kept for reuse. */
+void arena_reset(struct arena *a);
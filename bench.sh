@@ -0,0 +1,14 @@
+# Compare the context switch implementations in makejmp.c and the cursor
+# movement in term.c.
+set -e
+cc $CFLAGS -O2 -Wfatal-errors -Werror -DMAKEJMP_SETJMP makejmp_bench.c \
+	makejmp.c -o makejmp_bench
+./makejmp_bench
+cc $CFLAGS -O2 -Wfatal-errors -Werror makejmp_bench.c makejmp.c \
+	-o makejmp_bench
+./makejmp_bench
+rm makejmp_bench
+
+cc $CFLAGS -O2 -Wfatal-errors -Werror term_bench.c term.c -o term_bench
+./term_bench
+rm term_bench
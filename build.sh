@@ -1 +1 @@
-cc -Wfatal-errors -Werror -g main.c makejmp.c connection.c console.c game.c listener.c -o telnetkeys
+cc $CFLAGS -Wfatal-errors -Werror -g -pthread main.c uring.c timer.c arena.c levelpack.c makejmp.c stack.c term.c connection.c console.c game.c listener.c -o telnetkeys
@@ -1,27 +1,71 @@
+#define _GNU_SOURCE
 #include "connection.h"
 #include "player.h"
-#define _GNU_SOURCE
+#include "term.h"
 #include <unistd.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
+#include <strings.h>
 #include <assert.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+
+/* Build with -DCONNECTION_STATE_MACHINE to run the reader and writer as
+ * state machines instead of as coroutines. */
+#ifdef CONNECTION_STATE_MACHINE
+#define ENGINE "state machine"
+#else
+#define ENGINE "coroutines"
 #include "makejmp.h"
+#include "stack.h"
+#endif
+
+/* The write buffer is a chain of segments. A connection that has more than
+ * WRITEBUF_MAX bytes of segments drops what it can and refreshes
+ * instead. */
+#define SEGMENT_LEN 4096
+#ifndef WRITEBUF_MAX
+#define WRITEBUF_MAX (16 * SEGMENT_LEN)
+#endif
+
+/* Refreshes only add to the buffer while there is less than this in it, so
+ * that updates are not queued behind a whole screen. */
+#define REFRESH_WATERMARK SEGMENT_LEN
 
-/* Size of stack for writer() and reader() in bytes. */
-#define STACK 4096
+/* Most segments written with one sendmsg(). */
+#define MAX_IOV (WRITEBUF_MAX / SEGMENT_LEN)
 
-/* Max updates we can buffer. */
-#define WRITEBUF_LEN 1024
+/* Updates are encoded once for every distinct terminal state among the
+ * connections of a game, up to this many states. */
+#define MAX_SHARED 8
 
-/* Make sure there is room for updates in the buffer if neccesary. */
-#define RESERVED_FOR_UPDATES 256
+/* Shared updates shorter than this are copied into the write buffer rather
+ * than referenced. */
+#define SHARE_MIN 1024
+
+/* Most tiles that look different to this player than to others. */
+#define MAX_PRIVATE 4
+
+/* Rewriting this many cells is never longer than a relative move. */
+#define MAX_REPRINT 3
 
 #define READBUF_LEN 256
 
+/* Longest telnet subnegotiation we look at. Terminal types are at most 40
+ * characters. */
+#define SB_LEN 48
+
+/* Telnet TERMINAL-TYPE option. */
+#define TTYPE 24
+
 struct connection {
 	void *(*add_fd)(
 		void *user,
@@ -30,6 +74,12 @@ struct connection {
 		int (*callback)(void *user1, unsigned revents),
 		void *user1);
 	void (*remove_fd)(void *user, void *fd_ptr);
+	ssize_t (*recv_fd)(
+		void *user,
+		void *fd_ptr,
+		int fd,
+		void *buf,
+		size_t len);
 	void *fd_ptr;
 	void *user;
 
@@ -37,8 +87,17 @@ struct connection {
 
 	void (*stop_request)(void *user);
 
+#ifdef CONNECTION_STATE_MACHINE
+	/* Where the writer continues. */
+	enum {
+		WRITER_RUNNING,
+		WRITER_FINISHING,
+		WRITER_DONE,
+	} writer_state;
+#else
 	unsigned char *reader_stack, *writer_stack;
 	jmp_buf reader, writer, main;
+#endif
 
 	int fd;
 	enum {
@@ -61,15 +120,26 @@ struct connection {
 		FD_REMOVED = 128,
 		/* Have we been asked by the game to stop? */
 		WANT_STOP = 256,
+		/* Terminal capabilities. */
+		HAS_REP = 512,
+		/* Clear the screen before the next refresh. Set along with
+		 * an unknown shadow. */
+		MUST_CLEAR = 1024,
+		/* Handling input from the client. Its updates are written
+		 * together once all of it has been handled. */
+		IN_READER = 2048,
+		/* Is TCP_CORK set? */
+		CORKED = 4096,
 	} flags;
 
 	struct player *player;
+	struct connection_cache *cache;
 
-	/* Write buffer. */
+	/* Write buffer. Bytes in it and how many segments' worth they
+	 * take. One segment is kept when the buffer is empty. */
 	unsigned refresh_progress;
-	unsigned writebuf_start, writebuf_len;
-	char writebuf[WRITEBUF_LEN];
-	unsigned char atomic_delimiter[(WRITEBUF_LEN + 7) / 8];
+	unsigned writebuf_len, n_segments;
+	struct segment *head, *tail, *spare;
 
 	/* Read buffer. */
 	unsigned readbuf_len;
@@ -80,24 +150,127 @@ struct connection {
 	unsigned cursor_x, cursor_y;
 	unsigned fg, bg;
 
+	/* What the terminal shows once everything in the write buffer has
+	 * been written, w * h cells. */
+	struct cell *shadow;
+
+	/* Cells only this player sees as they are, as indices into the
+	 * shadow, and a hash of the rest of it. Connections with the same
+	 * hash, cursor, colors and flags get the same bytes for an update. */
+	unsigned n_private;
+	unsigned private_cells[MAX_PRIVATE];
+	unsigned long long screen_hash;
+
+	/* Frame being encoded. Output goes there instead of to the write
+	 * buffer. */
+	struct frame *frame;
+
+	/* Bytes spent on cursor movement, and what absolute moves alone
+	 * would have taken. */
+	unsigned long long move_bytes, cup_bytes;
+
 	/* Reader state */
 	enum {
 		TELNET_NORMAL,
 		TELNET_IAC,
 		TELNET_SB,
-		TELNET_BYTE1,
+		TELNET_SB_IAC,
+		TELNET_OPTION,
 	} telnet_state;
+	unsigned char telnet_command;
+	unsigned sb_len;
+	unsigned char sb[SB_LEN];
 
 	enum {
 		TERMINAL_NORMAL,
 		TERMINAL_ESC,
 		TERMINAL_1,
 	} terminal_state;
+
+	/* Time spent in update() and refresh(). */
+	unsigned long long n_updates, update_nsec;
+
+	/* Times updates did not fit in WRITEBUF_MAX. */
+	unsigned long long n_overflows;
+
+	/* Calls to sendmsg() and what they wrote. */
+	unsigned long long n_sends, bytes_sent;
+
+	/* Updates and refreshes encoded here and taken from another
+	 * connection. */
+	unsigned long long n_encoded, n_shared;
+};
+
+/* A cell with fg UNKNOWN might show anything. */
+struct cell {
+	unsigned char ch, fg, bg;
+};
+#define UNKNOWN 255
+
+/* The bytes for one update or refresh, encoded from one terminal state.
+ * Connections in that state take them instead of encoding again. */
+struct frame {
+	unsigned refs;
+
+	/* The state it was encoded from. */
+	unsigned long long hash;
+	unsigned cursor_x, cursor_y, fg, bg, flags;
+
+	/* The state it leaves. If clears is set, the screen was cleared
+	 * before the cells were written. */
+	unsigned long long end_hash;
+	unsigned end_cursor_x, end_cursor_y, end_fg, end_bg, end_flags;
+	unsigned clears;
+	unsigned n_cells;
+	unsigned *cell_index;
+	struct cell *cells;
+
+	unsigned len, max_len;
+	char *data;
+	unsigned char *atomic_delimiter;
+};
+
+/* The frames for the latest update of a game. */
+struct connection_cache {
+	unsigned long long number;
+	unsigned n_frames;
+	struct frame *frames[MAX_SHARED];
+};
+
+/* Writes never cross segments. */
+struct segment {
+	struct segment *next;
+	/* Bytes from start to end are yet to be written. */
+	unsigned start, end;
+	/* What it counts for in n_segments. */
+	unsigned weight;
+
+	/* Data of a frame if set, otherwise of the own_segment it is in. */
+	struct frame *frame;
+	char *data;
+	unsigned char *atomic_delimiter;
+};
+
+/* A segment with its own data. Frames only need the header. seg is first,
+ * so the segment can be freed through it. */
+struct own_segment {
+	struct segment seg;
+	char data[SEGMENT_LEN];
+	unsigned char atomic_delimiter[SEGMENT_LEN / 8];
 };
 
 static int fd_event(void *user, unsigned revents);
+static void free_segments(struct connection *c);
+static void forget_screen(struct connection *c);
+static void resume_reader(struct connection *c);
+static void call_reader(struct connection *c);
+static void call_writer(struct connection *c);
+#ifdef CONNECTION_STATE_MACHINE
+static void start_writer(struct connection *c);
+#else
 static void reader(void *user);
 static void writer(void *user);
+#endif
 
 static void try_remove_fd(struct connection *c)
 {
@@ -109,6 +282,34 @@ static void try_remove_fd(struct connection *c)
 	}
 }
 
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct connection_stats stats;
+
+/* Add what a closing connection counted to the totals. */
+static void add_stats(struct connection *c)
+{
+	pthread_mutex_lock(&stats_lock);
+	++stats.connections;
+	stats.updates += c->n_updates;
+	stats.update_nsec += c->update_nsec;
+	stats.move_bytes += c->move_bytes;
+	stats.cup_bytes += c->cup_bytes;
+	stats.overflows += c->n_overflows;
+	stats.sends += c->n_sends;
+	stats.bytes_sent += c->bytes_sent;
+	stats.encoded += c->n_encoded;
+	stats.shared += c->n_shared;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void connection_get_stats(struct connection_stats *stats_out)
+{
+	pthread_mutex_lock(&stats_lock);
+	*stats_out = stats;
+	pthread_mutex_unlock(&stats_lock);
+	stats_out->engine = ENGINE;
+}
+
 void update(void *user, unsigned n_tiles, unsigned *coords);
 void refresh(void *user);
 void game_stop_player(void *user);
@@ -117,7 +318,8 @@ static int connection(
 		struct connection *c,
 		struct connection **c_out,
 		struct game *g,
-		int socket,
+		struct connection_cache *cache,
+		int fd,
 		void *(*add_fd)(
 			void *user,
 			int fd,
@@ -125,6 +327,12 @@ static int connection(
 			int (*callback)(void *user1, unsigned revents),
 			void *user1),
 		void (*remove_fd)(void *user, void *fd_ptr),
+		ssize_t (*recv_fd)(
+			void *user,
+			void *fd_ptr,
+			int fd,
+			void *buf,
+			size_t len),
 		void (*stop)(void *user),
 		void *user)
 {
@@ -135,21 +343,30 @@ static int connection(
 
 	c->add_fd = add_fd;
 	c->remove_fd = remove_fd;
+	c->recv_fd = recv_fd;
 	c->stop_request = stop;
 	c->user = user;
 	c->flags = READABLE | WRITABLE;
 
-	c->writebuf_start = 0;
 	c->writebuf_len = 0;
+	c->n_segments = 0;
+	c->head = NULL;
+	c->tail = NULL;
+	c->spare = NULL;
 
 	c->readbuf_len = 0;
 
 	c->w = 80;
 	c->h = 24;
-	c->cursor_x = UINT_MAX;
-	c->cursor_y = UINT_MAX;
-	c->fg = 7;
-	c->bg = 0;
+
+	c->cache = cache;
+	c->frame = NULL;
+	c->n_private = 0;
+
+	/* Also sets up the cursor, colors and hash. */
+	c->shadow = malloc(c->w * c->h * sizeof *c->shadow);
+	if(!c->shadow) goto e_shadow;
+	forget_screen(c);
 
 	c->refresh_progress = 0;
 	c->stop_callback = NULL;
@@ -157,23 +374,46 @@ static int connection(
 	c->telnet_state = TELNET_NORMAL;
 	c->terminal_state = TERMINAL_NORMAL;
 
-	c->fd = accept4(socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
-	if(c->fd < 0) goto e_accept;
+	c->n_updates = 0;
+	c->update_nsec = 0;
+	c->move_bytes = 0;
+	c->cup_bytes = 0;
+	c->n_overflows = 0;
+	c->n_sends = 0;
+	c->bytes_sent = 0;
+	c->n_encoded = 0;
+	c->n_shared = 0;
 
-	c->fd_ptr = c->add_fd(c->user, c->fd, 7, fd_event, c);
+	c->fd = fd;
+
+	/* Frames are written whole, so Nagle would only delay them. */
+	int one = 1;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+	c->fd_ptr = c->add_fd(c->user, c->fd, 7 | 16, fd_event, c);
 	if(!c->fd_ptr) goto e_add_fd;
 
-	c->reader_stack = malloc(STACK);
-	if(!c->reader_stack) goto e_malloc_reader;
+#ifndef CONNECTION_STATE_MACHINE
+	c->reader_stack = stack_alloc();
+	if(!c->reader_stack) goto e_stack_reader;
 
-	c->writer_stack = malloc(STACK);
-	if(!c->writer_stack) goto e_malloc_writer;
+	c->writer_stack = stack_alloc();
+	if(!c->writer_stack) goto e_stack_writer;
+#endif
 
 	if(player_new(&c->player, g, update, refresh,
 				game_stop_player, c) < 0) goto e_player;
 
-	makejmp(c->reader, c->reader_stack, STACK, reader, c);
-	makejmp(c->writer, c->writer_stack, STACK, writer, c);
+#ifdef CONNECTION_STATE_MACHINE
+	/* Do initial setup. */
+	resume_reader(c);
+	if(c->flags & ERROR) goto e_reader;
+
+	start_writer(c);
+	if(c->flags & ERROR) goto e_writer;
+#else
+	makejmp(c->reader, c->reader_stack, stack_size(), reader, c);
+	makejmp(c->writer, c->writer_stack, stack_size(), writer, c);
 
 	/* Do initial setup. */
 	swapjmp(c->main, c->reader);
@@ -181,27 +421,35 @@ static int connection(
 
 	swapjmp(c->main, c->writer);
 	if(c->flags & ERROR) goto e_writer;
+#endif
 
 	*c_out = c;
 	return 0;
 
 free:
+	add_stats(c);
 	c->flags |= FREE;
-	while(!(c->flags & READER_STOPPED)) swapjmp(c->main, c->reader);
+	while(!(c->flags & READER_STOPPED)) resume_reader(c);
 e_writer:
 	c->flags |= FREE;
-	while(!(c->flags & WRITER_STOPPED)) swapjmp(c->main, c->writer);
+	while(!(c->flags & WRITER_STOPPED)) call_writer(c);
 e_reader:
 	player_free(c->player);
+	free_segments(c);
 e_player:
-	free(c->writer_stack);
-e_malloc_writer:
-	free(c->reader_stack);
-e_malloc_reader:
-	try_remove_fd(c);
+#ifndef CONNECTION_STATE_MACHINE
+	stack_release(c->writer_stack);
+e_stack_writer:
+	stack_release(c->reader_stack);
+e_stack_reader:
+#endif
+	/* Unless it was stopped, the fd is still registered. */
+	if(!(c->flags & FD_REMOVED)) c->remove_fd(c->user, c->fd_ptr);
 e_add_fd:
-	close(c->fd);
-e_accept:
+	/* The fd stays with the caller if we fail. */
+	if(!c_out) close(c->fd);
+	free(c->shadow);
+e_shadow:
 	free(c);
 e_malloc:
 	return -1;
@@ -210,7 +458,8 @@ e_malloc:
 int connection_new(
 		struct connection **c_out,
 		struct game *g,
-		int socket,
+		struct connection_cache *cache,
+		int fd,
 		void *(*add_fd)(
 			void *user,
 			int fd,
@@ -218,51 +467,60 @@ int connection_new(
 			int (*callback)(void *user1, unsigned revents),
 			void *user1),
 		void (*remove_fd)(void *user, void *fd_ptr),
+		ssize_t (*recv_fd)(
+			void *user,
+			void *fd_ptr,
+			int fd,
+			void *buf,
+			size_t len),
 		void (*stop)(void *user),
 		void *user)
 {
-	return connection(NULL, c_out, g, socket, add_fd, remove_fd, stop,
-			user);
+	return connection(NULL, c_out, g, cache, fd, add_fd, remove_fd,
+			recv_fd, stop, user);
 }
 
 void connection_free(struct connection *c)
 {
-	if(c) connection(c, NULL, NULL, 0, NULL, NULL, NULL, NULL);
+	if(c) connection(c, NULL, NULL, NULL, 0, NULL, NULL, NULL, NULL,
+			NULL);
 }
 
 void connection_stop(struct connection *c, void (*cb)(void *))
 {
 	c->stop_callback = cb;
 	c->flags |= STOP;
-	swapjmp(c->main, c->reader);
-	swapjmp(c->main, c->writer);
-	try_remove_fd(c);
+	resume_reader(c);
+	call_writer(c);
+	/* Errors can stop both contexts before we are asked to. */
+	if(c->flags & FD_REMOVED) cb(c->user);
+	else try_remove_fd(c);
 }
 
-static void call_reader(struct connection *c);
-static void call_writer(struct connection *c);
-
 static int fd_event(void *user, unsigned revents)
 {
 	struct connection *c = user;
 	unsigned old_flags = c->flags;
+	/* Events only say what became ready. Reading and writing clear the
+	 * flags when the socket says EAGAIN. */
 	if(revents & 1) c->flags |= READABLE;
-	else c->flags &= ~READABLE;
 	if(revents & 2) c->flags |= WRITABLE;
-	else c->flags &= ~WRITABLE;
 
+	c->flags |= IN_READER;
 	call_reader(c);
+	c->flags &= ~IN_READER;
 	call_writer(c);
 
 	try_remove_fd(c);
 
-	int ret = c->flags & ERROR ? -1 : 0;
+	/* A broken connection only stops itself. */
+	if(c->flags & ERROR && !(old_flags & ERROR)) c->flags |= WANT_STOP;
 	if(c->flags & WANT_STOP) {
 		c->flags &= ~WANT_STOP;
 		c->stop_request(c->user);
 	}
 
-	return ret;
+	return 0;
 }
 
 /*
@@ -276,71 +534,202 @@ void game_stop_player(void *user)
 }
 
 static int buffer_write(struct connection *c, char *data, unsigned len);
+static char *buffer_space(struct connection *c, unsigned len);
+static void buffer_commit(struct connection *c, unsigned len);
 static void clear_buffer(struct connection *c);
+static int share_frame(struct connection *c, unsigned n, unsigned *coords);
 
-static int update_tile(struct connection *c, unsigned x, unsigned y)
+/* What a cell adds to the screen hash. */
+static unsigned long long cell_hash(unsigned i, struct cell *cell)
 {
-	char data[32];
-	unsigned len = 0;
-
-	unsigned ch, bg, fg;
-	player_get_tile(c->player, x, y, &ch, &bg, &fg);
+	unsigned long long h = (unsigned long long)i << 24 |
+		cell->ch << 16 | cell->fg << 8 | cell->bg;
+	/* splitmix64 finalizer. */
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+	return h;
+}
 
-	/* Move cursor if neccesary. */
-	if(x != c->cursor_x || y != c->cursor_y) {
-		len += snprintf(data + len, sizeof data - len,
-				"\x1b[%d;%dH", y + 1, x + 1);
+static unsigned is_private(struct connection *c, unsigned i)
+{
+	unsigned j;
+	for(j = 0; j < c->n_private; ++j) {
+		if(c->private_cells[j] == i) return 1;
 	}
-	c->cursor_x = x + 1;
-	c->cursor_y = y;
+	return 0;
+}
 
-	/* Change background and foreground colors. */
-	if(fg != c->fg || bg != c->bg) {
-		len += snprintf(data + len, sizeof data - len, "\x1b[");
+static void rehash(struct connection *c)
+{
+	unsigned i;
+	c->screen_hash = 0;
+	for(i = 0; i < c->w * c->h; ++i) {
+		if(!is_private(c, i))
+			c->screen_hash ^= cell_hash(i, &c->shadow[i]);
 	}
-	if(fg != c->fg) {
-		len += snprintf(data + len, sizeof data - len, "%d", fg + 30);
+}
+
+/* Change a cell of the shadow and record it in the frame being
+ * encoded. */
+static void set_cell(
+		struct connection *c,
+		unsigned i,
+		unsigned ch,
+		unsigned fg,
+		unsigned bg)
+{
+	struct cell *cell = &c->shadow[i];
+	unsigned shared = !is_private(c, i);
+	if(shared) c->screen_hash ^= cell_hash(i, cell);
+	cell->ch = ch;
+	cell->fg = fg;
+	cell->bg = bg;
+	if(shared) c->screen_hash ^= cell_hash(i, cell);
+
+	struct frame *f = c->frame;
+	if(f) {
+		f->cell_index[f->n_cells] = i;
+		f->cells[f->n_cells++] = *cell;
 	}
-	if(fg != c->fg && bg != c->bg) {
-		len += snprintf(data + len, sizeof data - len, ";");
+}
+
+/* Ask the game which cells are private now. */
+static void update_private(struct connection *c)
+{
+	unsigned coords[2 * MAX_PRIVATE];
+	unsigned n = player_get_private_tiles(c->player, coords, MAX_PRIVATE);
+	unsigned i, changed = n != c->n_private;
+	for(i = 0; i < n; ++i) {
+		unsigned index = coords[2 * i + 1] * c->w + coords[2 * i];
+		if(i >= c->n_private || c->private_cells[i] != index)
+			changed = 1;
+		c->private_cells[i] = index;
 	}
-	if(bg != c->bg) {
-		len += snprintf(data + len, sizeof data - len, "%d", bg + 40);
+	c->n_private = n;
+	if(changed) rehash(c);
+}
+
+/* Can the cursor get from where it is to x on the same line by writing
+ * the cells in between again? They must have the current colors. */
+static unsigned can_reprint(struct connection *c, unsigned x, unsigned y)
+{
+	if(y != c->cursor_y || x <= c->cursor_x) return 0;
+	if(x - c->cursor_x > MAX_REPRINT) return 0;
+
+	unsigned i;
+	for(i = c->cursor_x; i < x; ++i) {
+		struct cell *cell = &c->shadow[y * c->w + i];
+		if(cell->ch < 32 || cell->ch > 126) return 0;
+		if(cell->fg != c->fg || cell->bg != c->bg) return 0;
+		/* Shared frames can't hold them. */
+		if(is_private(c, y * c->w + i)) return 0;
 	}
-	if(fg != c->fg || bg != c->bg) {
-		len += snprintf(data + len, sizeof data - len, "m");
+	return 1;
+}
+
+static int update_tile(struct connection *c, unsigned x, unsigned y)
+{
+	unsigned ch, bg, fg;
+	player_get_tile(c->player, x, y, &ch, &bg, &fg);
+
+	/* Nothing to do if the client already shows it. */
+	struct cell *cell = &c->shadow[y * c->w + x];
+	if(cell->ch == ch && cell->fg == fg && cell->bg == bg) return 0;
+
+	/* Encode straight into the write buffer if there is room. */
+	char tmp[TERM_CUP_MAX + TERM_SGR_MAX + 1];
+	char *data = buffer_space(c, sizeof tmp);
+	if(!data) data = tmp;
+	unsigned len = 0, move = 0, cup = 0;
+
+	/* Move cursor if neccesary. Relative moves need to know where the
+	 * cursor is, which we don't after writing to the last column. */
+	if(x != c->cursor_x || y != c->cursor_y) {
+		cup = term_cup(data, x, y);
+		if(c->cursor_x >= c->w) {
+			len = cup;
+		}
+		else if(can_reprint(c, x, y)) {
+			unsigned i;
+			for(i = c->cursor_x; i < x; ++i)
+				data[len++] = c->shadow[y * c->w + i].ch;
+		}
+		else {
+			len = term_move(data, c->cursor_x, c->cursor_y, x, y);
+		}
+		move = len;
 	}
-	c->fg = fg;
-	c->bg = bg;
+
+	/* Change background and foreground colors. */
+	len += term_sgr(data + len, fg, bg, c->fg, c->bg);
 
 	/* Write the character. */
 	data[len++] = ch;
 
-	if(buffer_write(c, data, len) < 0) return -1;
+	if(data != tmp) buffer_commit(c, len);
+	else if(buffer_write(c, data, len) < 0) return -1;
 
+	/* The client will show it once the bytes are queued. Where the
+	 * cursor ends up after anything but ASCII depends on the client's
+	 * character set, but the rest of a UTF-8 sequence must follow
+	 * without moving. */
+	set_cell(c, y * c->w + x, ch, fg, bg);
+	c->move_bytes += move;
+	c->cup_bytes += cup;
+	c->cursor_x = x + 1;
+	c->cursor_y = y;
+	if(ch < 32 || (ch > 126 && ch < 0xc0)) c->cursor_x = UINT_MAX;
+	c->fg = fg;
+	c->bg = bg;
 	return 0;
 }
 
+static unsigned long long clock_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 void update(void *user, unsigned n_tiles, unsigned *coords)
 {
 	struct connection *c = user;
-	unsigned i;
-	for(i = 0; i < n_tiles; ++i) {
-		if(update_tile(c, coords[2 * i], coords[2 * i + 1]) < 0) {
-			clear_buffer(c);
-			c->refresh_progress = 0;
-			break;
-		}
+	unsigned long long start = clock_nsec();
+	update_private(c);
+	if(n_tiles && share_frame(c, n_tiles, coords) < 0) {
+		++c->n_overflows;
+		clear_buffer(c);
+		forget_screen(c);
+		c->refresh_progress = 0;
 	}
-	swapjmp(c->main, c->writer);
+	/* The end of a frame. */
+	if(!(c->flags & IN_READER)) call_writer(c);
+	++c->n_updates;
+	c->update_nsec += clock_nsec() - start;
 }
 
 void refresh(void *user)
 {
 	struct connection *c = user;
-	clear_buffer(c);
+	unsigned long long start = clock_nsec();
+	/* Queued writes stay, the shadow tells what has changed since. A
+	 * refresh behind a lot of them is written bit by bit instead. */
+	update_private(c);
 	c->refresh_progress = 0;
-	swapjmp(c->main, c->writer);
+	if(c->writebuf_len < REFRESH_WATERMARK) {
+		if(share_frame(c, 0, NULL) < 0) {
+			++c->n_overflows;
+			clear_buffer(c);
+			forget_screen(c);
+		}
+		else c->refresh_progress = c->w * c->h;
+	}
+	if(!(c->flags & IN_READER)) call_writer(c);
+	++c->n_updates;
+	c->update_nsec += clock_nsec() - start;
 }
 
 /*
@@ -371,6 +760,34 @@ static void read_terminal_char(struct connection *c, unsigned char ch)
 	}
 }
 
+/* Ask for the terminal type once the client agrees to send it. */
+static unsigned char ttype_send[] = {255, 250, TTYPE, 1, 255, 240};
+
+static void read_telnet_option(struct connection *c, unsigned char ch)
+{
+	/* Without room for the request we never learn the terminal type,
+	 * which is fine. */
+	if(c->telnet_command == 251 && ch == TTYPE)
+		buffer_write(c, (char *)ttype_send, sizeof ttype_send);
+}
+
+static void read_telnet_sb(struct connection *c)
+{
+	/* TERMINAL-TYPE IS name. */
+	if(c->sb_len < 2 || c->sb[0] != TTYPE || c->sb[1] != 0) return;
+	char *name = (char *)c->sb + 2;
+	unsigned len = c->sb_len - 2;
+
+	/* Terminals known to support REP. */
+	static const char *const rep[] = {"xterm", "tmux"};
+	unsigned i;
+	for(i = 0; i < sizeof rep / sizeof *rep; ++i) {
+		unsigned rep_len = strlen(rep[i]);
+		if(len >= rep_len && !strncasecmp(name, rep[i], rep_len))
+			c->flags |= HAS_REP;
+	}
+}
+
 static void read_telnet_char(struct connection *c, unsigned char ch)
 {
 	if(c->telnet_state == TELNET_NORMAL) {
@@ -383,32 +800,100 @@ static void read_telnet_char(struct connection *c, unsigned char ch)
 			c->telnet_state = TELNET_NORMAL;
 		}
 		else if(ch == 250) {
+			c->sb_len = 0;
 			c->telnet_state = TELNET_SB;
 		}
 		else if(ch == 251 || ch == 252 || ch == 253 || ch == 254) {
-			c->telnet_state = TELNET_BYTE1;
+			c->telnet_command = ch;
+			c->telnet_state = TELNET_OPTION;
 		}
 		else {
 			c->telnet_state = TELNET_NORMAL;
 		}
 	}
 	else if(c->telnet_state == TELNET_SB) {
-		if(ch == 240) c->telnet_state = TELNET_NORMAL;
+		if(ch == 255) c->telnet_state = TELNET_SB_IAC;
+		else if(c->sb_len < SB_LEN) c->sb[c->sb_len++] = ch;
+	}
+	else if(c->telnet_state == TELNET_SB_IAC) {
+		if(ch == 255) {
+			if(c->sb_len < SB_LEN) c->sb[c->sb_len++] = ch;
+			c->telnet_state = TELNET_SB;
+		}
+		else {
+			if(ch == 240) read_telnet_sb(c);
+			c->telnet_state = TELNET_NORMAL;
+		}
 	}
-	else if(c->telnet_state == TELNET_BYTE1) {
+	else if(c->telnet_state == TELNET_OPTION) {
+		read_telnet_option(c, ch);
 		c->telnet_state = TELNET_NORMAL;
 	}
 }
 
-static void call_reader(struct connection *c)
+/* Read what is available into readbuf. Returns 0 if there was nothing. */
+static int read_some(struct connection *c)
 {
+	int status = c->recv_fd(c->user, c->fd_ptr, c->fd, c->readbuf,
+			sizeof c->readbuf);
+	if(status < 0 && errno != EAGAIN) {
+		c->flags |= ERROR;
+		c->flags &= ~READABLE;
+		return -1;
+	}
+	if(status == 0 || status < 0 && errno == EAGAIN) {
+		c->flags &= ~READABLE;
+		return 0;
+	}
+	c->readbuf_len = status;
+	return status;
+}
+
+static void handle_readbuf(struct connection *c)
+{
+	unsigned i;
+	for(i = 0; i < c->readbuf_len; ++i) {
+		read_telnet_char(c, c->readbuf[i]);
+	}
+	c->readbuf_len = 0;
+}
+
+#ifdef CONNECTION_STATE_MACHINE
+
+static void resume_reader(struct connection *c)
+{
+	if(c->flags & READER_STOPPED) return;
+	if(c->flags & (FREE | STOP)) {
+		c->flags |= READER_STOPPED;
+		return;
+	}
+
 	while(c->flags & READABLE) {
-		swapjmp(c->main, c->reader);
-		unsigned i;
-		for(i = 0; i < c->readbuf_len; ++i) {
-			read_telnet_char(c, c->readbuf[i]);
+		if(read_some(c) < 0) {
+			c->flags |= READER_STOPPED;
+			return;
 		}
-		c->readbuf_len = 0;
+		handle_readbuf(c);
+	}
+}
+
+static void call_reader(struct connection *c)
+{
+	resume_reader(c);
+}
+
+#else
+
+static void resume_reader(struct connection *c)
+{
+	swapjmp(c->main, c->reader);
+}
+
+static void call_reader(struct connection *c)
+{
+	while(c->flags & READABLE && !(c->flags & READER_STOPPED)) {
+		resume_reader(c);
+		handle_readbuf(c);
 	}
 }
 
@@ -418,16 +903,8 @@ static void reader(void *user)
 
 	while(!(c->flags & FREE) && !(c->flags & STOP)) {
 		while(c->flags & READABLE) {
-			int status = read(c->fd, c->readbuf, sizeof c->readbuf);
-			if(status < 0 && errno != EAGAIN) {
-				c->flags |= ERROR;
-				goto e_read;
-			}
-			if(status == 0 || status < 0 && errno == EAGAIN) {
-				c->flags &= ~READABLE;
-				break;
-			}
-			c->readbuf_len = status;
+			if(read_some(c) < 0) goto e_read;
+			if(!c->readbuf_len) break;
 			swapjmp(c->reader, c->main);
 		}
 		swapjmp(c->reader, c->main);
@@ -438,117 +915,339 @@ e_read:
 	while(1) swapjmp(c->reader, c->main);
 }
 
+#endif
+
 /*
  * Writer.
  */
 
-static unsigned is_atomic_delimiter(struct connection *c, unsigned byte)
+static unsigned is_atomic_delimiter(unsigned char *bits, unsigned byte)
 {
-	return (c->atomic_delimiter[byte / 8] >> (byte % 8)) & 1;
+	return (bits[byte / 8] >> (byte % 8)) & 1;
 }
 
-static void set_atomic_delimiter(struct connection *c, unsigned byte)
+static void set_atomic_delimiter(unsigned char *bits, unsigned byte)
 {
-	c->atomic_delimiter[byte / 8] |= 1 << (byte % 8);
+	bits[byte / 8] |= 1 << (byte % 8);
 }
 
-static void clear_atomic_delimiter(struct connection *c, unsigned byte)
+static void clear_atomic_delimiter(unsigned char *bits, unsigned byte)
 {
-	c->atomic_delimiter[byte / 8] &= ~(1 << (byte % 8));
+	bits[byte / 8] &= ~(1 << (byte % 8));
 }
 
-static int buffer_write(struct connection *c, char *data, unsigned len)
+static int frame(
+		struct frame *f,
+		struct frame **f_out,
+		unsigned max_cells,
+		unsigned max_len)
 {
-	if(c->writebuf_len + len > WRITEBUF_LEN) return -1;
-	if(!len) return 0;
+	if(f) goto free;
 
-	unsigned write_start = (c->writebuf_start + c->writebuf_len) %
-		WRITEBUF_LEN;
+	f = malloc(sizeof *f);
+	if(!f) goto e_malloc;
 
-	unsigned i;
-	if(write_start + len < WRITEBUF_LEN) {
-		/* Normal write. */
-		memcpy(c->writebuf + write_start, data, len);
-		set_atomic_delimiter(c, write_start);
-		for(i = 1; i < len; ++i) {
-			clear_atomic_delimiter(c, write_start + i);
-		}
+	f->cell_index = malloc(max_cells * sizeof *f->cell_index);
+	if(!f->cell_index) goto e_cell_index;
+
+	f->cells = malloc(max_cells * sizeof *f->cells);
+	if(!f->cells) goto e_cells;
+
+	f->data = malloc(max_len);
+	if(!f->data) goto e_data;
+
+	f->atomic_delimiter = malloc((max_len + 7) / 8);
+	if(!f->atomic_delimiter) goto e_atomic_delimiter;
+
+	f->refs = 1;
+	f->clears = 0;
+	f->n_cells = 0;
+	f->len = 0;
+	f->max_len = max_len;
+
+	*f_out = f;
+	return 0;
+
+free:
+	free(f->atomic_delimiter);
+e_atomic_delimiter:
+	free(f->data);
+e_data:
+	free(f->cells);
+e_cells:
+	free(f->cell_index);
+e_cell_index:
+	free(f);
+e_malloc:
+	return -1;
+}
+
+/* Room for every cell to need a move, colors and the character, and for a
+ * clear. */
+static int frame_new(struct frame **f_out, unsigned max_cells)
+{
+	return frame(NULL, f_out, max_cells,
+			max_cells * (TERM_CUP_MAX + TERM_SGR_MAX + 1) +
+			TERM_SGR_MAX + TERM_ED_MAX);
+}
+
+static void frame_unref(struct frame *f)
+{
+	if(!--f->refs) frame(f, NULL, 0, 0);
+}
+
+/* Drop the frames of an older update. */
+static void cache_reset(struct connection_cache *cc, unsigned long long number)
+{
+	while(cc->n_frames) frame_unref(cc->frames[--cc->n_frames]);
+	cc->number = number;
+}
+
+static int connection_cache(
+		struct connection_cache *cc,
+		struct connection_cache **cc_out)
+{
+	if(cc) goto free;
+
+	cc = malloc(sizeof *cc);
+	if(!cc) goto e_malloc;
+
+	cc->number = 0;
+	cc->n_frames = 0;
+
+	*cc_out = cc;
+	return 0;
+
+free:
+	cache_reset(cc, 0);
+	free(cc);
+e_malloc:
+	return -1;
+}
+
+int connection_cache_new(struct connection_cache **cc_out)
+{
+	return connection_cache(NULL, cc_out);
+}
+
+void connection_cache_free(struct connection_cache *cc)
+{
+	if(cc) connection_cache(cc, NULL);
+}
+
+/* Segments' worth of buffer that len bytes take. A shared frame can be
+ * longer than one segment. */
+static unsigned segment_weight(unsigned len)
+{
+	return len > SEGMENT_LEN ? (len + SEGMENT_LEN - 1) / SEGMENT_LEN : 1;
+}
+
+static void release_segment(struct connection *c, struct segment *seg)
+{
+	c->n_segments -= seg->weight;
+	if(seg->frame) {
+		frame_unref(seg->frame);
+		free(seg);
+	}
+	else if(!c->spare) c->spare = seg;
+	else free(seg);
+}
+
+static void free_segments(struct connection *c)
+{
+	while(c->head) {
+		struct segment *seg = c->head;
+		c->head = seg->next;
+		release_segment(c, seg);
+	}
+	free(c->spare);
+}
+
+/* Add a segment at the end of the buffer. */
+static struct segment *add_segment(struct connection *c, struct frame *f)
+{
+	unsigned weight = f ? segment_weight(f->len) : 1;
+	if((c->n_segments + weight) * SEGMENT_LEN > WRITEBUF_MAX) return NULL;
+	struct segment *seg;
+	if(f) {
+		seg = malloc(sizeof *seg);
+		if(!seg) return NULL;
+		seg->data = f->data;
+		seg->atomic_delimiter = f->atomic_delimiter;
+		seg->end = f->len;
+		++f->refs;
 	}
 	else {
-		/* Crosses end of circular buffer. */
-		unsigned bytes_1 = WRITEBUF_LEN - write_start;
-		memcpy(c->writebuf + write_start, data, bytes_1);
-		memcpy(c->writebuf, data + bytes_1, len - bytes_1);
-		set_atomic_delimiter(c, write_start);
-		for(i = 1; i < bytes_1; ++i) {
-			clear_atomic_delimiter(c, write_start + i);
-		}
-		for(; i < len; ++i) {
-			clear_atomic_delimiter(c, i - bytes_1);
-		}
+		struct own_segment *own = (struct own_segment *)c->spare;
+		if(own) c->spare = NULL;
+		else own = malloc(sizeof *own);
+		if(!own) return NULL;
+		seg = &own->seg;
+		seg->data = own->data;
+		seg->atomic_delimiter = own->atomic_delimiter;
+		seg->end = 0;
+	}
+	seg->frame = f;
+	seg->next = NULL;
+	seg->start = 0;
+	if(c->tail) c->tail->next = seg;
+	else c->head = seg;
+	c->tail = seg;
+	seg->weight = weight;
+	c->n_segments += weight;
+	return seg;
+}
+
+/* Contiguous free space for len bytes at the end of the buffer, or NULL.
+ * Written bytes are added with buffer_commit(). While a frame is being
+ * encoded, this is space in the frame. */
+static char *buffer_space(struct connection *c, unsigned len)
+{
+	struct frame *f = c->frame;
+	if(f) return f->len + len <= f->max_len ? f->data + f->len : NULL;
+
+	struct segment *seg = c->tail;
+	if(seg && !seg->frame && seg->end + len <= SEGMENT_LEN)
+		return seg->data + seg->end;
+
+	/* Start a new segment. */
+	if(len > SEGMENT_LEN) return NULL;
+	seg = add_segment(c, NULL);
+	return seg ? seg->data : NULL;
+}
+
+/* Add len bytes at the end of the buffer as one atomic write. */
+static void buffer_commit(struct connection *c, unsigned len)
+{
+	unsigned char *bits;
+	unsigned *end;
+	if(c->frame) {
+		bits = c->frame->atomic_delimiter;
+		end = &c->frame->len;
 	}
-	c->writebuf_len += len;
+	else {
+		bits = c->tail->atomic_delimiter;
+		end = &c->tail->end;
+		c->writebuf_len += len;
+	}
+
+	unsigned i;
+	set_atomic_delimiter(bits, *end);
+	for(i = 1; i < len; ++i) clear_atomic_delimiter(bits, *end + i);
+	*end += len;
+}
+
+static int buffer_write(struct connection *c, char *data, unsigned len)
+{
+	if(!len) return 0;
+	char *space = buffer_space(c, len);
+	if(!space) return -1;
+	memcpy(space, data, len);
+	buffer_commit(c, len);
 	return 0;
 }
 
+static void forget_screen(struct connection *c)
+{
+	unsigned i;
+	c->flags |= MUST_CLEAR;
+	for(i = 0; i < c->w * c->h; ++i) c->shadow[i].fg = UNKNOWN;
+	rehash(c);
+	c->cursor_x = UINT_MAX;
+	c->cursor_y = UINT_MAX;
+	c->fg = UINT_MAX;
+	c->bg = UINT_MAX;
+}
+
+/* What the screen holds after it has been cleared. */
+static void blank_screen(struct connection *c)
+{
+	unsigned i;
+	for(i = 0; i < c->w * c->h; ++i) {
+		c->shadow[i].ch = ' ';
+		c->shadow[i].fg = 7;
+		c->shadow[i].bg = 0;
+	}
+	rehash(c);
+}
+
 /* Remove all writes in the buffer that we can without breaking atomicity. */
 static void clear_buffer(struct connection *c)
 {
+	struct segment *seg = c->head;
+	if(!seg) return;
+
+	/* Keep the rest of a write that has been partly written. */
 	unsigned i;
-	for(i = 0; i < c->writebuf_len; ++i) {
-		unsigned pos = c->writebuf_start + i;
-		if(pos >= WRITEBUF_LEN) pos -= WRITEBUF_LEN;
-		if(is_atomic_delimiter(c, pos)) break;
+	for(i = seg->start; i < seg->end; ++i) {
+		if(is_atomic_delimiter(seg->atomic_delimiter, i)) break;
+	}
+	unsigned len = i - seg->start;
+
+	/* What the dropped writes did to the screen is lost. */
+	if(len != c->writebuf_len) forget_screen(c);
+	c->writebuf_len = len;
+	seg->end = i;
+	while(seg->next) {
+		struct segment *next = seg->next;
+		seg->next = next->next;
+		release_segment(c, next);
 	}
-	c->writebuf_len = i;
-	if(!c->writebuf_len) c->writebuf_start = 0;
+	c->tail = seg;
+	assert(c->n_segments == seg->weight);
 }
 
-/* Write as much as we can from the circular buffer without blocking. */
+/* Write as much as we can from the buffer without blocking, all segments
+ * in one call if the socket takes them. */
 static int nonblocking_write(struct connection *c)
 {
-	if(!(c->flags & WRITABLE)) return 0;
+	while(c->flags & WRITABLE && c->writebuf_len) {
+		struct iovec iov[MAX_IOV];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof msg);
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 0;
+		struct segment *seg;
+		unsigned len = 0;
+		for(seg = c->head; seg && msg.msg_iovlen < MAX_IOV;
+				seg = seg->next) {
+			if(seg->start == seg->end) continue;
+			iov[msg.msg_iovlen].iov_base = seg->data + seg->start;
+			iov[msg.msg_iovlen].iov_len = seg->end - seg->start;
+			len += seg->end - seg->start;
+			++msg.msg_iovlen;
+		}
 
-	if(c->writebuf_start + c->writebuf_len > WRITEBUF_LEN) {
-		/* Two parts */
-		unsigned bytes_1 = WRITEBUF_LEN - c->writebuf_start;
-		int status = write(c->fd, c->writebuf + c->writebuf_start,
-				bytes_1);
-		if(status < 0 && errno != EAGAIN) {
-			goto error;
+		/* No SIGPIPE if the peer is gone, we get EPIPE instead. */
+		int status = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+		++c->n_sends;
+		if(status < 0 && errno == EAGAIN) {
+			c->flags &= ~WRITABLE;
+			break;
 		}
-		else if(status == WRITEBUF_LEN -
-				c->writebuf_start) {
-			/* Full write. */
-			c->writebuf_start = 0;
-			c->writebuf_len -= bytes_1;
-			status = write(c->fd, c->writebuf, c->writebuf_len);
-			if(status < 0 && errno != EAGAIN) {
-				goto error;
-			}
-			else if(status >= 0) {
-				c->writebuf_start = status;
-				c->writebuf_len = c->writebuf_len - status;
+		if(status < 0) goto error;
+		c->bytes_sent += status;
+		c->writebuf_len -= status;
+
+		unsigned left = status;
+		while(left) {
+			seg = c->head;
+			unsigned n = seg->end - seg->start;
+			if(n > left) n = left;
+			seg->start += n;
+			left -= n;
+			if(seg->start == seg->end) {
+				c->head = seg->next;
+				if(!c->head) c->tail = NULL;
+				release_segment(c, seg);
+				assert(c->head || !c->n_segments);
 			}
 		}
-		else {
-			c->writebuf_start += status;
-			c->writebuf_len -= status;
-		}
-	}
-	else {
-		/* Buffer is one part. */
-		int status = write(c->fd, c->writebuf + c->writebuf_start,
-				c->writebuf_len);
-		if(status < 0 && errno != EAGAIN) {
-			goto error;
-		}
-		else if(status >= 0) {
-			c->writebuf_start += status;
-			c->writebuf_len -= status;
-		}
+
+		/* The socket is full, so don't ask it again just to hear
+		 * EAGAIN. We are told when there is room. */
+		if(status < len) c->flags &= ~WRITABLE;
 	}
-	if(!c->writebuf_len) c->writebuf_start = 0;
 	return 0;
 
 error:
@@ -556,19 +1255,350 @@ error:
 	return -1;
 }
 
+/* Clear the screen so that a refresh only needs to draw what is not
+ * blank. */
+static int clear_screen(struct connection *c)
+{
+	char data[TERM_SGR_MAX + TERM_ED_MAX];
+	unsigned len = term_sgr(data, 7, 0, c->fg, c->bg);
+	len += term_ed(data + len);
+	if(buffer_write(c, data, len) < 0) return -1;
+
+	blank_screen(c);
+	if(c->frame) c->frame->clears = 1;
+	c->fg = 7;
+	c->bg = 0;
+	/* The last character written might be gone, see repeat_cells(). */
+	c->cursor_x = UINT_MAX;
+	c->flags &= ~MUST_CLEAR;
+	c->refresh_progress = 0;
+	return 0;
+}
+
+/* The cell left of the cursor was the last one written. If the cells from
+ * the cursor on should be the same, repeat it. Returns how many cells
+ * that covered. */
+static int repeat_cells(struct connection *c)
+{
+	unsigned x = c->cursor_x, y = c->cursor_y;
+	if(!(c->flags & HAS_REP) || !x || x >= c->w) return 0;
+	struct cell *last = &c->shadow[y * c->w + x - 1];
+	if(last->ch < 32 || last->ch > 126) return 0;
+	if(is_private(c, y * c->w + x - 1)) return 0;
+
+	unsigned n = 0;
+	while(x + n < c->w && !is_private(c, y * c->w + x + n)) {
+		unsigned ch, bg, fg;
+		player_get_tile(c->player, x + n, y, &ch, &bg, &fg);
+		if(ch != last->ch || fg != last->fg || bg != last->bg) break;
+		struct cell *cell = &c->shadow[y * c->w + x + n];
+		if(cell->ch == ch && cell->fg == fg && cell->bg == bg) break;
+		++n;
+	}
+	if(n < TERM_REP_MIN) return 0;
+
+	char data[TERM_REP_MAX];
+	if(buffer_write(c, data, term_rep(data, n)) < 0) return -1;
+	unsigned i;
+	for(i = 0; i < n; ++i) {
+		set_cell(c, y * c->w + x + i, last->ch, last->fg, last->bg);
+	}
+	c->cursor_x += n;
+	return n;
+}
+
 static void write_level(struct connection *c)
 {
+	if(c->flags & MUST_CLEAR && clear_screen(c) < 0) return;
 	while(1) {
 		if(c->refresh_progress == c->w * c->h) return;
-		if((WRITEBUF_LEN - c->writebuf_len) < RESERVED_FOR_UPDATES)
-			return;
-		if(update_tile(c, c->refresh_progress % c->w,
-					c->refresh_progress / c->w) < 0)
-			return;
+		if(c->writebuf_len >= REFRESH_WATERMARK) return;
+
+		/* Runs of the same cell, where the cursor already is. */
+		unsigned x = c->refresh_progress % c->w;
+		unsigned y = c->refresh_progress / c->w;
+		if(x == c->cursor_x && y == c->cursor_y) {
+			int n = repeat_cells(c);
+			if(n < 0) return;
+			if(n) {
+				c->refresh_progress += n;
+				continue;
+			}
+		}
+
+		if(update_tile(c, x, y) < 0) return;
 		++c->refresh_progress;
 	}
 }
 
+/* Encode the tiles at coords, or all of the screen if coords is NULL,
+ * leaving out private cells. */
+static int encode_cells(struct connection *c, unsigned n, unsigned *coords)
+{
+	unsigned i;
+	if(coords) {
+		for(i = 0; i < n; ++i) {
+			unsigned x = coords[2 * i], y = coords[2 * i + 1];
+			if(is_private(c, y * c->w + x)) continue;
+			if(update_tile(c, x, y) < 0) return -1;
+		}
+		return 0;
+	}
+
+	if(c->flags & MUST_CLEAR && clear_screen(c) < 0) return -1;
+	for(i = 0; i < c->w * c->h;) {
+		unsigned x = i % c->w, y = i / c->w;
+		if(is_private(c, i)) {
+			++i;
+			continue;
+		}
+		if(x == c->cursor_x && y == c->cursor_y) {
+			int run = repeat_cells(c);
+			if(run < 0) return -1;
+			if(run) {
+				i += run;
+				continue;
+			}
+		}
+		if(update_tile(c, x, y) < 0) return -1;
+		++i;
+	}
+	return 0;
+}
+
+static unsigned frame_matches(struct connection *c, struct frame *f)
+{
+	return f->hash == c->screen_hash &&
+		f->cursor_x == c->cursor_x && f->cursor_y == c->cursor_y &&
+		f->fg == c->fg && f->bg == c->bg &&
+		f->flags == (c->flags & (HAS_REP | MUST_CLEAR));
+}
+
+/* Encode a frame from the current state. The connection ends up in the
+ * state it leaves. */
+static struct frame *encode_frame(
+		struct connection *c,
+		unsigned n,
+		unsigned *coords)
+{
+	struct frame *f;
+	if(frame_new(&f, coords ? n : c->w * c->h) < 0) return NULL;
+	f->hash = c->screen_hash;
+	f->cursor_x = c->cursor_x;
+	f->cursor_y = c->cursor_y;
+	f->fg = c->fg;
+	f->bg = c->bg;
+	f->flags = c->flags & (HAS_REP | MUST_CLEAR);
+
+	c->frame = f;
+	int status = encode_cells(c, n, coords);
+	c->frame = NULL;
+	if(status < 0) {
+		frame_unref(f);
+		return NULL;
+	}
+
+	f->end_hash = c->screen_hash;
+	f->end_cursor_x = c->cursor_x;
+	f->end_cursor_y = c->cursor_y;
+	f->end_fg = c->fg;
+	f->end_bg = c->bg;
+	f->end_flags = c->flags & (HAS_REP | MUST_CLEAR);
+	return f;
+}
+
+/* Do to the shadow what encoding the frame did to the encoder's. */
+static void apply_frame(struct connection *c, struct frame *f)
+{
+	unsigned i;
+	if(f->clears) blank_screen(c);
+	for(i = 0; i < f->n_cells; ++i)
+		c->shadow[f->cell_index[i]] = f->cells[i];
+	c->screen_hash = f->end_hash;
+	c->cursor_x = f->end_cursor_x;
+	c->cursor_y = f->end_cursor_y;
+	c->fg = f->end_fg;
+	c->bg = f->end_bg;
+	c->flags = (c->flags & ~MUST_CLEAR) | (f->end_flags & MUST_CLEAR);
+}
+
+/* Short frames are copied, long ones are referenced. */
+static int queue_frame(struct connection *c, struct frame *f)
+{
+	if(!f->len) return 0;
+	if(f->len >= SHARE_MIN) {
+		if(!add_segment(c, f)) return -1;
+		c->writebuf_len += f->len;
+		return 0;
+	}
+
+	char *data = buffer_space(c, f->len);
+	if(!data) return -1;
+	memcpy(data, f->data, f->len);
+	unsigned start = c->tail->end, i;
+	buffer_commit(c, f->len);
+	for(i = 1; i < f->len; ++i) {
+		if(is_atomic_delimiter(f->atomic_delimiter, i))
+			set_atomic_delimiter(c->tail->atomic_delimiter,
+					start + i);
+	}
+	return 0;
+}
+
+/* Bring the client up to date with the tiles at coords, or with all of
+ * the screen if coords is NULL. The shared cells are encoded once for all
+ * connections of the game in the same state. */
+static int share_frame(struct connection *c, unsigned n, unsigned *coords)
+{
+	struct connection_cache *cc = c->cache;
+	unsigned long long number = player_get_frame(c->player);
+	if(cc->number != number) cache_reset(cc, number);
+
+	unsigned i;
+	struct frame *f = NULL;
+	for(i = 0; i < cc->n_frames; ++i) {
+		if(frame_matches(c, cc->frames[i])) {
+			f = cc->frames[i];
+			break;
+		}
+	}
+
+	if(f) {
+		apply_frame(c, f);
+		++f->refs;
+		++c->n_shared;
+	}
+	else {
+		f = encode_frame(c, n, coords);
+		if(!f) return -1;
+		if(cc->n_frames < MAX_SHARED) {
+			cc->frames[cc->n_frames++] = f;
+			++f->refs;
+		}
+		++c->n_encoded;
+	}
+	int status = queue_frame(c, f);
+	frame_unref(f);
+	if(status < 0) return -1;
+
+	/* Then what only this player sees. */
+	for(i = 0; i < c->n_private; ++i) {
+		unsigned index = c->private_cells[i], j;
+		if(coords) {
+			for(j = 0; j < n; ++j) {
+				if(coords[2 * j + 1] * c->w + coords[2 * j] ==
+						index) break;
+			}
+			if(j == n) continue;
+		}
+		if(update_tile(c, index % c->w, index / c->w) < 0) return -1;
+	}
+	return 0;
+}
+
+/* To set up telnet and the terminal. */
+static unsigned char setup[] = {
+	255, 253, 34,
+	255, 250, 34, 1, 0, 255, 240,
+	255, 251, 1,
+	255, 251, 3,
+	255, 253, TTYPE,
+	27, '[', '?', '4', '7', 'h',
+	27, '[', '?', '2', '5', 'l',
+	/* Enable S8C1T: 27, ' ', 'G' */
+	27, '[', '?', '1', 'h',
+};
+/* To reset the terminal. */
+static unsigned char finish[] = {
+	27, '[', '3', '7', ';', '4', '0', 'm',
+	27, '[', '?', '2', '5', 'h',
+	27, '[', '?', '1', '0', '4', '7', 'l',
+};
+
+static void set_cork(struct connection *c, int cork)
+{
+	setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof cork);
+	if(cork) c->flags |= CORKED;
+	else c->flags &= ~CORKED;
+}
+
+/* Write until there is nothing to write or the fd is not writable. */
+static int write_all(struct connection *c)
+{
+	while(1) {
+		/* Add as much of the level to the write buffer as
+		 * possible. */
+		write_level(c);
+
+		/* Nothing to do? */
+		if(!c->writebuf_len) break;
+
+		/* A refresh that takes more than one write is corked so
+		 * that it goes out in full segments. */
+		if(c->refresh_progress != c->w * c->h &&
+				!(c->flags & CORKED)) set_cork(c, 1);
+
+		/* Write as much of the write buffer as possible. */
+		if(nonblocking_write(c) < 0) return -1;
+
+		/* Not writable? */
+		if(!(c->flags & WRITABLE)) return 0;
+	}
+
+	/* The frame is complete. */
+	if(c->flags & CORKED) set_cork(c, 0);
+	return 0;
+}
+
+#ifdef CONNECTION_STATE_MACHINE
+
+static void start_writer(struct connection *c)
+{
+	c->writer_state = WRITER_RUNNING;
+	if(buffer_write(c, setup, sizeof setup) < 0) {
+		c->flags |= ERROR | WRITER_STOPPED;
+		c->writer_state = WRITER_DONE;
+		return;
+	}
+	call_writer(c);
+}
+
+/* Does what writer() does between two yields. */
+static void call_writer(struct connection *c)
+{
+	switch(c->writer_state) {
+	case WRITER_RUNNING:
+		if(c->flags & FREE) goto done;
+		if(c->flags & STOP) {
+			/* Disconnect. */
+			clear_buffer(c);
+			if(buffer_write(c, finish, sizeof finish) < 0) {
+				goto done;
+			}
+			c->writer_state = WRITER_FINISHING;
+			goto finishing;
+		}
+		if(write_all(c) < 0) goto done;
+		return;
+
+	case WRITER_FINISHING:
+		if(c->flags & FREE) goto done;
+	finishing:
+		if(nonblocking_write(c) < 0) goto done;
+		if(!c->writebuf_len) goto done;
+		return;
+
+	case WRITER_DONE:
+		return;
+	}
+
+done:
+	c->writer_state = WRITER_DONE;
+	c->flags |= WRITER_STOPPED;
+}
+
+#else
+
 static void call_writer(struct connection *c)
 {
 	swapjmp(c->main, c->writer);
@@ -578,44 +1608,13 @@ static void writer(void *user)
 {
 	struct connection *c = user;
 
-	/* To set up telnet and the terminal. */
-	static unsigned char setup[] = {
-		255, 253, 34,
-		255, 250, 34, 1, 0, 255, 240,
-		255, 251, 1,
-		255, 251, 3,
-		27, '[', '?', '4', '7', 'h',
-		27, '[', '?', '2', '5', 'l',
-		/* Enable S8C1T: 27, ' ', 'G' */
-		27, '[', '?', '1', 'h',
-	};
-	/* To reset the terminal. */
-	static unsigned char finish[] = {
-		27, '[', '3', '7', ';', '4', '0', 'm',
-		27, '[', '?', '2', '5', 'h',
-		27, '[', '?', '1', '0', '4', '7', 'l',
-	};
-
 	if(buffer_write(c, setup, sizeof setup) < 0) {
 		c->flags |= ERROR;
 		goto e_write;
 	}
 
 	while(1) {
-		while(1) {
-			/* Add as much of the level to the write buffer as
-			 * possible. */
-			write_level(c);
-
-			/* Nothing to do? */
-			if(!c->writebuf_len) break;
-
-			/* Write as much of the write buffer as possible. */
-			if(nonblocking_write(c) < 0) goto e_write;
-
-			/* Not writable? */
-			if(!(c->flags & WRITABLE)) break;
-		}
+		if(write_all(c) < 0) goto e_write;
 
 		/* Wait for writability or for something else to happen. */
 		swapjmp(c->writer, c->main);
@@ -640,4 +1639,4 @@ e_write:
 	while(1) swapjmp(c->writer, c->main);
 }
 
-
+#endif
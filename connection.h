@@ -1,11 +1,41 @@
+#include <sys/types.h>
+
 struct connection;
+struct connection_cache;
 struct game;
 
-/* Socket is an fd on which accept() will be called. */
+/* Totals over the connections that have closed, in all threads. */
+struct connection_stats {
+	/* How the reader and writer run. */
+	const char *engine;
+	unsigned long long connections;
+	/* Time spent in screen updates and refreshes. */
+	unsigned long long updates, update_nsec;
+	/* Bytes of cursor movement, and what absolute moves alone would
+	 * have taken. */
+	unsigned long long move_bytes, cup_bytes;
+	/* Times updates did not fit in the write buffer. */
+	unsigned long long overflows;
+	/* Calls to sendmsg() and what they wrote. */
+	unsigned long long sends, bytes_sent;
+	/* Updates encoded by a connection and taken from another one. */
+	unsigned long long encoded, shared;
+};
+
+void connection_get_stats(struct connection_stats *stats_out);
+
+/* Holds what connections to the same game can share. Must outlive
+ * them. */
+int connection_cache_new(struct connection_cache **cc_out);
+void connection_cache_free(struct connection_cache *cc);
+
+/* Takes over fd, an accepted socket, unless it fails. It is read with
+ * recv_fd, which behaves like read(). */
 int connection_new(
 		struct connection **c_out,
 		struct game *g,
-		int socket,
+		struct connection_cache *cache,
+		int fd,
 		void *(*add_fd)(
 			void *user,
 			int fd,
@@ -13,6 +43,12 @@ int connection_new(
 			int (*callback)(void *user1, unsigned revents),
 			void *user1),
 		void (*remove_fd)(void *user, void *fd_ptr),
+		ssize_t (*recv_fd)(
+			void *user,
+			void *fd_ptr,
+			int fd,
+			void *buf,
+			size_t len),
 		void (*stop)(void *user),
 		void *user);
 void connection_stop(struct connection *c, void (*cb)(void *));
@@ -0,0 +1,100 @@
+/* Checks the write buffer bookkeeping in connection.c. Includes it to get
+ * at the static functions. Built and run by test.sh. */
+#include "connection.c"
+
+/* The game is not needed. */
+int player_new(
+		struct player **p_out,
+		struct game *g,
+		void (*partial_update)(
+			void *user,
+			unsigned n_tiles,
+			unsigned *coords),
+		void (*refresh_screen)(void *user),
+		void (*stop)(void *user),
+		void *user)
+{
+	return -1;
+}
+void player_free(struct player *p) {}
+void player_get_level_size(struct player *p, unsigned *w, unsigned *h) {}
+void player_get_tile(
+		struct player *p,
+		unsigned x,
+		unsigned y,
+		unsigned *ch_out,
+		unsigned *bg_out,
+		unsigned *fg_out) {}
+unsigned long long player_get_frame(struct player *p)
+{
+	return 0;
+}
+unsigned player_get_private_tiles(
+		struct player *p,
+		unsigned *coords,
+		unsigned max)
+{
+	return 0;
+}
+void player_key(struct player *p, unsigned char ch) {}
+void player_left(struct player *p) {}
+void player_right(struct player *p) {}
+void player_up(struct player *p) {}
+void player_down(struct player *p) {}
+
+static unsigned failures;
+
+static void check(unsigned ok, const char *what)
+{
+	if(ok) return;
+	printf("FAIL: %s\n", what);
+	++failures;
+}
+
+/* A shared frame longer than a segment is partly written when the buffer
+ * is cleared. What it counts for must go away with it, or the buffer
+ * fills up for good. */
+static void clear_partly_written_frame(void)
+{
+	static struct connection c;
+	struct frame f;
+	memset(&f, 0, sizeof f);
+	f.refs = 1;
+	f.len = 3 * SEGMENT_LEN;
+	f.data = calloc(1, f.len);
+	f.atomic_delimiter = calloc(1, f.len / 8);
+	set_atomic_delimiter(f.atomic_delimiter, 100);
+
+	unsigned i;
+	for(i = 0; i < WRITEBUF_MAX / SEGMENT_LEN; ++i) {
+		if(!add_segment(&c, &f)) {
+			check(0, "shared frame fits in an empty buffer");
+			break;
+		}
+		c.writebuf_len = f.len;
+		c.head->start = 50;
+		c.writebuf_len -= 50;
+		if(add_segment(&c, NULL)) c.tail->end = 10;
+		c.writebuf_len += 10;
+
+		clear_buffer(&c);
+		check(c.writebuf_len == 50, "rest of the write is kept");
+
+		struct segment *seg = c.head;
+		c.head = c.tail = NULL;
+		c.writebuf_len = 0;
+		release_segment(&c, seg);
+		check(!c.n_segments, "empty buffer counts no segments");
+	}
+	check(f.refs == 1, "segments let go of the frame");
+	free(f.data);
+	free(f.atomic_delimiter);
+}
+
+int main(void)
+{
+	clear_partly_written_frame();
+	if(failures) return 1;
+	printf("OK\n");
+	return 0;
+}
@@ -1,5 +1,8 @@
 #include "console.h"
 #include "game.h"
+#include "levelpack.h"
+#include "stack.h"
+#include "connection.h"
 #include <unistd.h>
 #include <string.h>
 #include <assert.h>
@@ -23,11 +26,14 @@ struct console {
 		void *user1);
 	void (*remove_fd)(void *user, void *fd_ptr);
 	void (*quit_f)(void *);
+	void (*for_each_game)(
+		void *user,
+		void (*f)(struct game *g, void *arg),
+		void *arg,
+		unsigned arg_sz);
 	void *fd_ptr;
 	void *user;
 
-	struct game *g;
-
 	unsigned old_flags;
 	unsigned waiting_on_stdin;
 
@@ -38,7 +44,11 @@ struct console {
 static int console(
 		struct console *c,
 		struct console **c_out,
-		struct game *g,
+		void (*for_each_game)(
+			void *user,
+			void (*f)(struct game *g, void *arg),
+			void *arg,
+			unsigned arg_sz),
 		void *(*add_fd)(
 			void *user,
 			int fd,
@@ -57,7 +67,7 @@ static int console(
 	c->add_fd = add_fd;
 	c->remove_fd = remove_fd;
 	c->user = user;
-	c->g = g;
+	c->for_each_game = for_each_game;
 	c->buf_len = 0;
 	c->quit_f = quit_f;
 
@@ -84,7 +94,11 @@ e_malloc:
 
 int console_new(
 		struct console **console_out,
-		struct game *g,
+		void (*for_each_game)(
+			void *user,
+			void (*f)(struct game *g, void *arg),
+			void *arg,
+			unsigned arg_sz),
 		void *(*add_fd)(
 			void *user,
 			int fd,
@@ -95,7 +109,8 @@ int console_new(
 		void (*quit_f)(void *),
 		void *user)
 {
-	return console(NULL, console_out, g, add_fd, remove_fd, quit_f, user);
+	return console(NULL, console_out, for_each_game, add_fd, remove_fd,
+			quit_f, user);
 }
 
 void console_free(struct console *c)
@@ -117,6 +132,78 @@ static unsigned one_argument(char *str, char *word, char **arg_out)
 	return 1;
 }
 
+static void load_game(struct game *g, void *arg)
+{
+	char *file = arg;
+	if(game_load(g, file) < 0) {
+		printf("Could not load \"%s\".\n", file);
+	}
+	else {
+		printf("Loaded \"%s\".\n", file);
+	}
+}
+
+static void compile_levels(char *args)
+{
+	char *dst = strchr(args, ' ');
+	if(!dst) {
+		printf("Usage: compile SRC DST\n");
+		return;
+	}
+	*dst++ = '\0';
+
+	int n = levelpack_compile(args, dst);
+	if(n < 0) {
+		printf("Could not compile \"%s\".\n", args);
+	}
+	else {
+		printf("Compiled %d levels to \"%s\".\n", n, dst);
+	}
+}
+
+static void print_stats(void)
+{
+	struct stack_stats st;
+	stack_get_stats(&st);
+	printf("Coroutine stacks: %u in use, %u pooled, %u bytes each, "
+			"at most %u bytes used.\n", st.in_use, st.pooled,
+			st.size, st.max_depth);
+
+	struct game_stats gs;
+	game_get_stats(&gs);
+	if(gs.levels) {
+		printf("Levels built: %llu, %.3f ms each (%.1f MB/s).\n",
+				gs.levels, gs.seconds * 1e3 / gs.levels,
+				gs.seconds > 0 ? gs.bytes / gs.seconds / 1e6 :
+				0.0);
+	}
+
+	struct connection_stats cs;
+	connection_get_stats(&cs);
+	printf("Closed connections: %llu.\n", cs.connections);
+	if(cs.updates) {
+		printf("Updates: %llu, %llu ns each (%s).\n", cs.updates,
+				cs.update_nsec / cs.updates, cs.engine);
+	}
+	if(cs.encoded || cs.shared) {
+		printf("Encoded: %llu, shared: %llu.\n", cs.encoded,
+				cs.shared);
+	}
+	if(cs.cup_bytes) {
+		printf("Cursor movement: %llu bytes, %llu with absolute moves "
+				"only.\n", cs.move_bytes, cs.cup_bytes);
+	}
+	if(cs.bytes_sent) {
+		printf("Sent %llu bytes in %llu calls, %.2f per KiB.\n",
+				cs.bytes_sent, cs.sends,
+				cs.sends * 1024.0 / cs.bytes_sent);
+	}
+	if(cs.overflows) {
+		printf("Write buffer overflowed %llu times.\n",
+				cs.overflows);
+	}
+}
+
 static void run_command(struct console *c, char *str)
 {
 	char *arg1;
@@ -127,18 +214,23 @@ static void run_command(struct console *c, char *str)
 		c->quit_f(c->user);
 	}
 	else if(one_argument(str, "load", &arg1)) {
-		if(game_load(c->g, arg1) < 0) {
-			printf("Could not load \"%s\".\n", arg1);
-		}
-		else {
-			printf("Loaded \"%s\".\n", arg1);
-		}
+		c->for_each_game(c->user, load_game, arg1, strlen(arg1) + 1);
+	}
+	else if(one_argument(str, "compile", &arg1)) {
+		compile_levels(arg1);
+	}
+	else if(!strcmp(str, "stats")) {
+		print_stats();
 	}
 	else if(!strcmp(str, "help")) {
 		printf("The following commands are supported:\n"
 				"  help       Print this text.\n"
 				"  quit       Stop the server and exit.\n"
-				"  load FILE  Load a set of levels.\n");
+				"  stats      Print statistics.\n"
+				"  load FILE  Load a set of levels.\n"
+				"  compile SRC DST\n"
+				"             Compile a set of levels to a file that\n"
+				"             loads without parsing.\n");
 	}
 	else {
 		printf("Invalid command. Write \"help\" for help.\n", str);
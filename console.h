@@ -3,7 +3,11 @@ struct game;
 
 int console_new(
 		struct console **console_out,
-		struct game *g,
+		void (*for_each_game)(
+			void *user,
+			void (*f)(struct game *g, void *arg),
+			void *arg,
+			unsigned arg_sz),
 		void *(*add_fd)(
 			void *user,
 			int fd,
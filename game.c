@@ -1,5 +1,8 @@
 #include "player.h"
 #include "game.h"
+#include "arena.h"
+#include "levelpack.h"
+#include "tiles.h"
 #include <unistd.h>
 #include <limits.h>
 #include <assert.h>
@@ -9,34 +12,56 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/epoll.h>
 #include <sys/types.h>
-#include <sys/timerfd.h>
 
 struct object;
+struct boulder;
 struct pusher;
+struct dirty;
 
 static void refresh_all(struct game *g);
 static void update_coords_all(struct game *g, unsigned n, unsigned *coords);
-static void object_free(struct object *o);
+static void dirty_clear(struct dirty *d);
+static void compose_screen(struct game *g);
+static void compose_tiles(struct game *g, unsigned n, unsigned *coords);
+static void draw_countdown(struct game *g, unsigned x, unsigned y,
+		unsigned n);
+static unsigned hud_covers(struct game *g, unsigned x, unsigned y);
+static void update_invalid(struct game *g);
+static void refresh_later(struct game *g);
 static void free_level(struct game *g);
-static int timer_f(void *user1, unsigned revents);
+static int levelset(unsigned freeing, struct game *g, char *level);
+static void timer_f(void *user1);
+static void tick_f(void *user1);
 static int add_player_to_game(struct player *p);
+static void remove_player_from_game(struct player *p);
 static int pusher_new(struct pusher **p_out, struct game *g, int x, int y,
 		char type);
 
 #define MAX_PLAYERS 16
-#define MAX_INVALID 16
+
+/* Inputs a player can have queued for the next tick. */
+#define MAX_INPUTS 8
 
 #define SLIDE_TIME_NSEC 50000000
 
+/* The screen players see. */
+#define SCREEN_W 80
+#define SCREEN_H 24
+
 enum tile_flags {
 	HAS_OBJECT = 1,
 };
 
+struct object;
 struct tile {
 	unsigned char flags;
 	char base;
+	/* Objects on this tile, lowest z first. */
+	struct object *objects;
 };
 
 struct object;
@@ -63,21 +88,61 @@ struct class {
 			unsigned *bg_out);
 };
 
+/* Owner of steps that no player took. */
+#define NO_PLAYER UINT_MAX
+
+/* A change to the level. Undo reverts the entries of a player's last
+ * step. */
+struct journal_entry {
+	enum {
+		/* Start of a step, like a player move. */
+		JOURNAL_STEP,
+		/* o moved from x, y to x1, y1. */
+		JOURNAL_MOVE,
+		/* o was removed from x, y. */
+		JOURNAL_REMOVE,
+		/* o had key before it got a new one. */
+		JOURNAL_KEY,
+	} type;
+	char key;
+	/* Number of the player a step belongs to, or NO_PLAYER. */
+	unsigned player;
+	unsigned x, y, x1, y1;
+	struct object *o;
+};
+
+/* A tile as the players see it. */
+struct screen_cell {
+	unsigned char ch, fg, bg;
+};
+
+/* A set of cells of the screen, one bit per cell. */
+struct dirty {
+	/* Rows with any bits set. */
+	unsigned long rows;
+	unsigned char bits[SCREEN_H][(SCREEN_W + 7) / 8];
+};
+
 struct object {
 	struct game *g;
 	struct class *class;
 	void *user;
 	unsigned x, y, z;
+	/* In tile.objects of the tile at x, y. */
+	struct object **tile_prev_p, *tile_next;
 };
 
 struct game {
-	void *(*add_fd)(
+	void *(*add_timer)(
 		void *user,
-		int fd,
-		unsigned events,
-		int (*callback)(void *user1, unsigned revents),
+		void (*callback)(void *user1),
 		void *user1);
-	void (*remove_fd)(void *user, void *fd_ptr);
+	void (*set_timer)(
+		void *user,
+		void *timer,
+		unsigned long long value_nsec,
+		unsigned long long interval_nsec);
+	void (*remove_timer)(void *user, void *timer);
 	void *user;
 
 	enum {
@@ -88,41 +153,79 @@ struct game {
 	} state;
 
 	unsigned countdown;
-	int timer_fd;
-	void *timer_fd_ptr;
+	void *timer;
+
+	/* If set, inputs wait for it and changes are sent when it fires
+	 * instead of right away. */
+	void *tick_timer;
+	/* The whole screen changed since the last tick. */
+	unsigned refresh_pending;
 
 	struct player *players[MAX_PLAYERS];
 	struct {
 		unsigned x, y;
 	} start_pos[MAX_PLAYERS];
 
-	int level_fd;
-	off_t level_offset;
+	struct levelpack *pack;
+	unsigned level_n;
+	/* The level as it was loaded. Used to restart it. */
+	struct level *image;
 
 	enum {
 		LEVEL_LOADING = 1,
+		/* Changes are not journaled while undoing. */
+		LEVEL_UNDOING = 2,
 	} level_flags;
 
 	unsigned w, h;
 	struct tile *level;
 
-	unsigned n_objects;
-	struct object **objects;
+	/* Objects other than players. Freed all at once with the level. */
+	struct arena *arena;
+
+	/* Boulders that hold a timer. */
+	struct boulder *sliding;
+
+	/* Tiles changed since the last update_invalid(). */
+	struct dirty invalid;
 
-	unsigned n_invalid_coords;
-	unsigned invalid_coords[2 * MAX_INVALID];
+	/* Changes since the level started, for undo. */
+	unsigned n_journal, journal_sz;
+	struct journal_entry *journal;
+	/* Owner of the current step. Slides it starts belong to it too. */
+	unsigned step_player;
+
+	/* Calls to refresh_all() and update_coords_all() so far. */
+	unsigned long long frame;
+
+	/* The screen as it looks to every player, composed again where
+	 * refresh_all() and update_coords_all() say it changed. Each player
+	 * sees itself at status_x, status_y, if they are set. */
+	struct screen_cell screen[SCREEN_W * SCREEN_H];
+	unsigned status_x, status_y;
+
+	/* The HUD layer. Cells with ch 0 show the playfield. */
+	struct screen_cell hud[SCREEN_W * SCREEN_H];
+	struct dirty hud_dirty;
+
+	/* For passing a set to update_coords_all(). */
+	unsigned update_coords[2 * SCREEN_W * SCREEN_H];
 };
 
 static int game(
 		struct game *g,
 		struct game **g_out,
-		void *(*add_fd)(
+		void *(*add_timer)(
 			void *user,
-			int fd,
-			unsigned events,
-			int (*callback)(void *user1, unsigned revents),
+			void (*callback)(void *user1),
 			void *user1),
-		void (*remove_fd)(void *user, void *fd_ptr),
+		void (*set_timer)(
+			void *user,
+			void *timer,
+			unsigned long long value_nsec,
+			unsigned long long interval_nsec),
+		void (*remove_timer)(void *user, void *timer),
+		unsigned tick_hz,
 		void *user)
 {
 	if(g) goto free;
@@ -130,19 +233,26 @@ static int game(
 	g = malloc(sizeof *g);
 	if(!g) goto e_malloc;
 
-	g->add_fd = add_fd;
-	g->remove_fd = remove_fd;
+	g->add_timer = add_timer;
+	g->set_timer = set_timer;
+	g->remove_timer = remove_timer;
 	g->user = user;
 	g->state = GAME_NONE;
 
 	g->w = 0;
 	g->h = 0;
 	g->level = NULL;
-	g->n_objects = 0;
-	g->objects = NULL;
+	g->sliding = NULL;
+	g->pack = NULL;
+	g->image = NULL;
 	g->countdown = 0;
-	g->n_invalid_coords = 0;
+	dirty_clear(&g->invalid);
 	g->level_flags = 0;
+	g->n_journal = 0;
+	g->journal_sz = 0;
+	g->journal = NULL;
+	g->step_player = NO_PLAYER;
+	g->frame = 0;
 
 	unsigned i;
 	for(i = 0; i < MAX_PLAYERS; ++i) {
@@ -150,22 +260,35 @@ static int game(
 		g->start_pos[i].x = UINT_MAX;
 		g->start_pos[i].y = UINT_MAX;
 	}
+	compose_screen(g);
 
-	g->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
-	if(g->timer_fd < 0) goto e_timerfd;
+	if(arena_new(&g->arena) < 0) goto e_arena;
 
-	g->timer_fd_ptr = g->add_fd(g->user, g->timer_fd, 1, timer_f, g);
-	if(!g->timer_fd_ptr) goto e_timer_fd_add;
+	g->timer = g->add_timer(g->user, timer_f, g);
+	if(!g->timer) goto e_add_timer;
+
+	g->tick_timer = NULL;
+	g->refresh_pending = 0;
+	if(tick_hz) {
+		g->tick_timer = g->add_timer(g->user, tick_f, g);
+		if(!g->tick_timer) goto e_add_tick_timer;
+		g->set_timer(g->user, g->tick_timer, 1000000000 / tick_hz,
+				1000000000 / tick_hz);
+	}
 
 	*g_out = g;
 	return 0;
 
 free:
-	free_level(g);
-	g->remove_fd(g->user, g->timer_fd_ptr);
-e_timer_fd_add:
-	close(g->timer_fd);
-e_timerfd:
+	if(g->pack) levelset(1, g, NULL);
+	else free_level(g);
+	free(g->journal);
+	if(g->tick_timer) g->remove_timer(g->user, g->tick_timer);
+e_add_tick_timer:
+	g->remove_timer(g->user, g->timer);
+e_add_timer:
+	arena_free(g->arena);
+e_arena:
 	free(g);
 e_malloc:
 	return -1;
@@ -173,40 +296,37 @@ e_malloc:
 
 int game_new(
 		struct game **game_out,
-		void *(*add_fd)(
+		void *(*add_timer)(
 			void *user,
-			int fd,
-			unsigned events,
-			int (*callback)(void *user1, unsigned revents),
+			void (*callback)(void *user1),
 			void *user1),
-		void (*remove_fd)(void *user, void *fd_ptr),
+		void (*set_timer)(
+			void *user,
+			void *timer,
+			unsigned long long value_nsec,
+			unsigned long long interval_nsec),
+		void (*remove_timer)(void *user, void *timer),
+		unsigned tick_hz,
 		void *user)
 {
-	return game(NULL, game_out, add_fd, remove_fd, user);
+	return game(NULL, game_out, add_timer, set_timer, remove_timer,
+			tick_hz, user);
 }
 
 void game_free(struct game *g)
 {
-	if(g) game(g, NULL, NULL, NULL, NULL);
+	if(g) game(g, NULL, NULL, NULL, NULL, 0, NULL);
 }
 
 static void start_countdown(struct game *g)
 {
 	g->countdown = 2;
-	struct itimerspec spec;
-	spec.it_interval.tv_sec = 1;
-	spec.it_interval.tv_nsec = 0;
-	spec.it_value.tv_sec = 1;
-	spec.it_value.tv_nsec = 0;
-	timerfd_settime(g->timer_fd, 0, &spec, NULL);
+	g->set_timer(g->user, g->timer, 1000000000, 1000000000);
 }
 
 static void stop_countdown(struct game *g)
 {
-	struct itimerspec spec = {};
-	spec.it_value.tv_sec = 0;
-	spec.it_value.tv_nsec = 0;
-	timerfd_settime(g->timer_fd, 0, &spec, NULL);
+	g->set_timer(g->user, g->timer, 0, 0);
 }
 
 static int update_countdown(struct game *g)
@@ -214,145 +334,208 @@ static int update_countdown(struct game *g)
 	if(g->countdown == 0) {
 		stop_countdown(g);
 		g->state = GAME_PLAYING;
-		refresh_all(g);
+		refresh_later(g);
 		return 0;
 	}
 	--g->countdown;
-	unsigned coords[] = {
-		35, 4, 35, 5, 35, 6, 35, 7, 35, 8, 35, 9, 35, 10,
-		36, 4, 36, 5, 36, 6, 36, 7, 36, 8, 36, 9, 36, 10,
-		37, 4, 37, 5, 37, 6, 37, 7, 37, 8, 37, 9, 37, 10,
-		38, 4, 38, 5, 38, 6, 38, 7, 38, 8, 38, 9, 38, 10,
-		39, 4, 39, 5, 39, 6, 39, 7, 39, 8, 39, 9, 39, 10,
-		40, 4, 40, 5, 40, 6, 40, 7, 40, 8, 40, 9, 40, 10,
-	};
-	update_coords_all(g, sizeof coords / sizeof coords[0] / 2, coords);
+	draw_countdown(g, 35, 4, g->countdown);
+	update_invalid(g);
 	return 0;
 }
 
-static int timer_f(void *user1, unsigned revents)
+static void timer_f(void *user1)
 {
 	struct game *g = user1;
-	uint64_t expirations;
-	read(g->timer_fd, &expirations, sizeof expirations);
-	while(expirations) {
-		update_countdown(g);
-		--expirations;
-	}
-	return 0;
+	update_countdown(g);
 }
 
 /*
  * Loading levels
  */
 
-static int resize_level(
+/* Allocate the grid. It is filled by fill_level(). */
+static int alloc_level(
 		struct game *g,
 		unsigned w,
 		unsigned h)
 {
-	unsigned w1, h1;
-	/* Only increase size. */
-	w1 = w > g->w ? w : g->w;
-	h1 = h > g->h ? h : g->h;
-	if(w1 == g->w && h1 == g->h) return 0;
-
-	static struct tile default_tile = {
-		.flags = 0,
-		.base = ' ',
-	};
-	struct tile *new_level;
-	unsigned new_sz = sizeof *new_level * w1 * h1;
-	new_level = malloc(new_sz);
-	if(!new_level) {
+	g->level = malloc(sizeof *g->level * w * h);
+	if(!g->level) {
 		fprintf(stderr, "%s", strerror(errno));
 		return -1;
 	}
+	g->w = w;
+	g->h = h;
+	return 0;
+}
 
-	unsigned x, y;
-	for(y = 0; y < h1; ++y) {
-		for(x = 0; x < w1; ++x) {
-			if(y < g->h && x < g->w) {
-				new_level[y * w1 + x] = g->level[y * g->w + x];
-			}
-			else {
-				new_level[y * w1 + x] = default_tile;
-			}
+static void dirty_clear(struct dirty *d)
+{
+	d->rows = 0;
+	memset(d->bits, 0, sizeof d->bits);
+}
+
+/* Cells off the screen are not kept, nobody sees them. */
+static void dirty_mark(struct dirty *d, unsigned x, unsigned y)
+{
+	if(x >= SCREEN_W || y >= SCREEN_H) return;
+	d->bits[y][x / 8] |= 1 << (x % 8);
+	d->rows |= 1UL << y;
+}
+
+/* Add the cells of src to d and clear src. */
+static void dirty_merge(struct dirty *d, struct dirty *src)
+{
+	while(src->rows) {
+		unsigned y = __builtin_ctzl(src->rows), i;
+		src->rows &= src->rows - 1;
+		for(i = 0; i < sizeof d->bits[y]; ++i) {
+			d->bits[y][i] |= src->bits[y][i];
+			src->bits[y][i] = 0;
 		}
+		d->rows |= 1UL << y;
 	}
+}
 
-	free(g->level);
-	g->level = new_level;
-	g->w = w1;
-	g->h = h1;
+/* Write the marked cells to coords row by row, left to right, and clear
+ * the set. Returns how many there were. */
+static unsigned dirty_take(struct dirty *d, unsigned *coords)
+{
+	unsigned n = 0;
+	while(d->rows) {
+		unsigned y = __builtin_ctzl(d->rows), i;
+		d->rows &= d->rows - 1;
+		for(i = 0; i < sizeof d->bits[y]; ++i) {
+			unsigned bits = d->bits[y][i];
+			d->bits[y][i] = 0;
+			while(bits) {
+				coords[2 * n] = i * 8 + __builtin_ctz(bits);
+				coords[2 * n + 1] = y;
+				++n;
+				bits &= bits - 1;
+			}
+		}
+	}
+	return n;
 }
 
+/* Only what the playfield shows through the HUD is kept. Whatever else
+ * changes is sent with the next refresh. */
 static void invalidate(struct game *g, unsigned x, unsigned y)
 {
 	if(g->level_flags & LEVEL_LOADING) return;
-	assert(g->n_invalid_coords + 1 < MAX_INVALID);
-	unsigned i = g->n_invalid_coords;
-	++g->n_invalid_coords;
-	g->invalid_coords[2 * i] = x;
-	g->invalid_coords[2 * i + 1] = y;
+	if(g->state != GAME_PLAYING) return;
+	if(x >= SCREEN_W || y >= SCREEN_H || hud_covers(g, x, y)) return;
+	dirty_mark(&g->invalid, x, y);
 }
 
-static int coords_cmp(const void *a, const void *b)
+/* Send what changed in the HUD and the playfield as one update, in the
+ * order it is on the screen. */
+static void send_changes(struct game *g)
 {
-	unsigned *aptr = (void *)a, *bptr = (void *)b;
-	unsigned ax = aptr[0], ay = aptr[1], bx = bptr[0], by = bptr[1];
-	if(ay < by) return -1;
-	else if(ay > by) return 1;
-	else {
-		if(ax < bx) return -1;
-		else if(ax > bx) return 1;
-		else return 0;
-	}
+	dirty_merge(&g->invalid, &g->hud_dirty);
+	unsigned n = dirty_take(&g->invalid, g->update_coords);
+	if(n) update_coords_all(g, n, g->update_coords);
 }
 
+/* Changes wait for the tick if there is one. */
 static void update_invalid(struct game *g)
 {
-	/* Sort so we don't need as many terminal warp commands. */
-	qsort(g->invalid_coords, g->n_invalid_coords,
-			2 * sizeof g->invalid_coords[0], coords_cmp);
-	update_coords_all(g, g->n_invalid_coords, g->invalid_coords);
-	g->n_invalid_coords = 0;
+	if(!g->tick_timer) send_changes(g);
 }
 
-static void recheck_tile_for_objects(struct game *g, unsigned x, unsigned y)
+/* So does a whole new screen. */
+static void refresh_later(struct game *g)
 {
-	unsigned has_object = 0;
-	unsigned i;
-	for(i = 0; i < g->n_objects; ++i) {
-		if(g->objects[i]->x == x && g->objects[i]->y == y) {
-			has_object = 1;
+	if(!g->tick_timer) refresh_all(g);
+	else g->refresh_pending = 1;
+}
+
+/* Put o in the object list of the tile at o->x, o->y. */
+static void link_to_tile(struct object *o)
+{
+	struct game *g = o->g;
+	struct tile *tile = &g->level[o->y * g->w + o->x];
+
+	/* Keep z order. Lowest first, and after objects with the same z. */
+	struct object **pp = &tile->objects;
+	while(*pp && (*pp)->z <= o->z) pp = &(*pp)->tile_next;
+
+	o->tile_prev_p = pp;
+	o->tile_next = *pp;
+	if(o->tile_next) o->tile_next->tile_prev_p = &o->tile_next;
+	*pp = o;
+	tile->flags |= HAS_OBJECT;
+}
+
+static void unlink_from_tile(struct game *g, struct object *o)
+{
+	*o->tile_prev_p = o->tile_next;
+	if(o->tile_next) o->tile_next->tile_prev_p = o->tile_prev_p;
+
+	struct tile *tile = &g->level[o->y * g->w + o->x];
+	if(!tile->objects) tile->flags &= ~HAS_OBJECT;
+}
+
+/*
+ * Undo journal
+ */
+
+/* Returns the new entry, or NULL if nothing is journaled. */
+static struct journal_entry *journal(struct game *g, unsigned type,
+		struct object *o, unsigned x, unsigned y, char key)
+{
+	if(g->level_flags & (LEVEL_LOADING | LEVEL_UNDOING)) return NULL;
+
+	/* An empty step is replaced by the next one, so that only the last
+	 * step can be empty. */
+	if(type == JOURNAL_STEP && g->n_journal &&
+			g->journal[g->n_journal - 1].type == JOURNAL_STEP) {
+		--g->n_journal;
+	}
+
+	if(g->n_journal == g->journal_sz) {
+		unsigned sz = g->journal_sz ? 2 * g->journal_sz : 64;
+		struct journal_entry *new_journal = realloc(g->journal,
+				sizeof *new_journal * sz);
+		if(!new_journal) {
+			/* Forget history rather than keep half a step. */
+			g->n_journal = 0;
+			return NULL;
 		}
+		g->journal = new_journal;
+		g->journal_sz = sz;
 	}
-	if(has_object) g->level[y * g->w + x].flags |= HAS_OBJECT;
-	else g->level[y * g->w + x].flags &= ~HAS_OBJECT;
-	invalidate(g, x, y);
+
+	struct journal_entry *e = &g->journal[g->n_journal++];
+	e->type = type;
+	e->o = o;
+	e->x = x;
+	e->y = y;
+	e->x1 = x;
+	e->y1 = y;
+	e->key = key;
+	e->player = NO_PLAYER;
+	return e;
+}
+
+static void begin_step(struct game *g, unsigned player)
+{
+	g->step_player = player;
+	struct journal_entry *e = journal(g, JOURNAL_STEP, NULL, 0, 0, 0);
+	if(e) e->player = player;
 }
 
 static void object_remove_2(struct object *o, unsigned call_callback)
 {
-	if(!o) return;
+	if(!o || !o->g) return;
 
 	struct game *g = o->g;
-	unsigned i;
-	for(i = 0; i < g->n_objects; ++i) {
-		if(g->objects[i] == o) {
-			o->g = NULL;
-			int x = o->x, y = o->y;
-			/* Might free o. */
-			if(call_callback) o->class->remove(o);
-			memmove(g->objects + i, g->objects + i + 1,
-					sizeof *g->objects *
-					(g->n_objects - i - 1));
-			--g->n_objects;
-			recheck_tile_for_objects(g, x, y);
-			return;
-		}
-	}
+	journal(g, JOURNAL_REMOVE, o, o->x, o->y, 0);
+	o->g = NULL;
+	unlink_from_tile(g, o);
+	if(call_callback && o->class->remove) o->class->remove(o);
+	invalidate(g, o->x, o->y);
 }
 
 static void object_remove(struct object *o)
@@ -360,8 +543,9 @@ static void object_remove(struct object *o)
 	object_remove_2(o, 1);
 }
 
-static int add_object_to_level(
-		struct object **o_out,
+/* The memory of o is owned by the caller. */
+static void add_object_to_level(
+		struct object *o,
 		struct game *g,
 		struct class *class,
 		unsigned x,
@@ -369,67 +553,63 @@ static int add_object_to_level(
 		unsigned z,
 		void *user)
 {
-	struct object *o = malloc(sizeof *o);
-	if(!o) return -1;
-
-	struct object **new_objects = realloc(g->objects,
-			sizeof *new_objects * (g->n_objects + 1));
-	if(!new_objects) {
-		free(o);
-		return -1;
-	}
-	g->objects = new_objects;
-
-	/* Insert to keep list z-sorted. Lowest first. */
-	unsigned i;
-	for(i = 0; i < g->n_objects; ++i) {
-		if(g->objects[i]->z > z) break;
-	}
-
-	memmove(new_objects + i + 1, new_objects + i,
-			sizeof *new_objects * (g->n_objects - i));
-
-	g->objects[i] = o;
-	g->objects[i]->g = g;
-	g->objects[i]->x = x;
-	g->objects[i]->y = y;
-	g->objects[i]->z = z;
-	g->objects[i]->class = class;
-	g->objects[i]->user = user;
-	++g->n_objects;
+	o->g = g;
+	o->x = x;
+	o->y = y;
+	o->z = z;
+	o->class = class;
+	o->user = user;
 
 	assert(g->w > x && g->h > y);
-	recheck_tile_for_objects(g, x, y);
-
-	*o_out = o;
-	return 0;
+	link_to_tile(o);
+	invalidate(g, x, y);
 }
 
-static void object_free(struct object *o)
+/* Allocate an object that lives as long as the level. */
+static struct object *new_level_object(
+		struct game *g,
+		struct class *class,
+		unsigned x,
+		unsigned y,
+		unsigned z,
+		void *user)
 {
-	if(o) {
-		if(o->g) object_remove_2(o, 0);
-		free(o);
-	}
+	struct object *o = arena_alloc(g->arena, sizeof *o);
+	if(!o) return NULL;
+	add_object_to_level(o, g, class, x, y, z, user);
+	return o;
 }
 
-static void free_level(struct game *g)
+static void boulder_stop(struct boulder *b);
+/* Remove all objects but keep the grid. */
+static void clear_level(struct game *g)
 {
-	g->level_flags |= LEVEL_LOADING;
-	while(g->n_objects) object_remove(g->objects[0]);
-	free(g->objects);
-	g->objects = NULL;
-
+	/* Players outlive the level. */
 	unsigned i;
 	for(i = 0; i < MAX_PLAYERS; ++i) {
+		if(g->players[i]) remove_player_from_game(g->players[i]);
 		g->start_pos[i].x = UINT_MAX;
 		g->start_pos[i].y = UINT_MAX;
 	}
 
+	/* Everything else is in the arena and only sliding boulders have
+	 * anything to release. */
+	while(g->sliding) boulder_stop(g->sliding);
+	arena_reset(g->arena);
+
+	/* The journal points into the arena. */
+	g->n_journal = 0;
+}
+
+static void free_level(struct game *g)
+{
+	g->level_flags |= LEVEL_LOADING;
+	clear_level(g);
 	free(g->level);
 	g->w = 0;
 	g->h = 0;
 	g->level = NULL;
+	g->image = NULL;
 	g->level_flags &= ~LEVEL_LOADING;
 }
 
@@ -440,125 +620,74 @@ static struct class bldr_class;
 struct boulder;
 static int boulder_new(struct boulder **b_out, struct game *g, unsigned x,
 		unsigned y);
-static char keys[] = "abcdefghijklmnopqrstuwxyz";
-static char doors[] = "ABCDEFGHIJKLMNOPQRSTUWXYZ";
-static int load_level(struct game *g)
+static double clock_sec(void)
 {
-	unsigned i;
-
-	free_level(g);
-
-	g->level_flags |= LEVEL_LOADING;
-
-	unsigned x = 0, y = 0;
-	unsigned was_newline = 0;
-	unsigned start_pos_n = 0;
-
-	g->level_offset = lseek(g->level_fd, 0, SEEK_CUR);
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-	char ch;
-	while(1) {
-		int status = read(g->level_fd, &ch, 1);
-		if(status < 0) {
-			fprintf(stderr, "%s", strerror(errno));
-			goto error;
-		}
-		if(status == 0) goto level_done;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct game_stats stats;
 
-		if(ch == '\n') {
-			if(was_newline) {
-				goto level_done;
-			}
-			x = 0;
-			++y;
-			was_newline = 1;
-			continue;
-		}
-		else {
-			was_newline = 0;
-		}
+void game_get_stats(struct game_stats *stats_out)
+{
+	pthread_mutex_lock(&stats_lock);
+	*stats_out = stats;
+	pthread_mutex_unlock(&stats_lock);
+}
 
-		if(ch == ' ' || ch == '\t') {
-			continue;
-		}
+static int add_level_object(struct game *g, const struct level_item *item)
+{
+	unsigned x = item->x, y = item->y;
+	char ch = item->type;
+	if(ch == '_') {
+		/* Ice */
+		if(!new_level_object(g, &ice_class, x, y, 0, NULL)) return -1;
+	}
+	else if(ch == '0') {
+		/* Boulder */
+		struct boulder *b;
+		if(boulder_new(&b, g, x, y) < 0) return -1;
+	}
+	else if(ch == '<' || ch == '>' || ch == '^' || ch == 'v') {
+		/* Pusher */
+		struct pusher *p;
+		if(pusher_new(&p, g, x, y, ch)) return -1;
+	}
+	else if(strchr(tile_keys, ch)) {
+		/* Keys */
+		if(!new_level_object(g, &key_class, x, y, 1,
+				(void *)(uintptr_t)ch)) return -1;
+	}
+	else if(strchr(tile_doors, ch)) {
+		/* Doors */
+		if(!new_level_object(g, &door_class, x, y, 1,
+				(void *)(uintptr_t)ch)) return -1;
+	}
+	return 0;
+}
 
-		if(resize_level(g, x + 1, y + 1) < 0) goto error;
-		struct tile *tile = &g->level[y * g->w + x];
+/* Set the grid and objects to how they are in g->image and put the
+ * players at their start positions. The grid must be allocated. */
+static int fill_level(struct game *g)
+{
+	struct level *l = g->image;
+	unsigned i;
 
-		if(ch == '.') {
-			/* Ground */
-			tile->base = ' ';
-			tile->flags = 0;
-		}
-		else if(ch == '#') {
-			/* Walls */
-			tile->base = '#';
-			tile->flags = 0;
-		}
-		else if(ch == '=') {
-			/* Goal */
-			tile->base = '=';
-			tile->flags = 0;
-		}
-		else if(ch == '@') {
-			/* Start position */
-			tile->base = ' ';
-			tile->flags = 0;
-			if(start_pos_n < MAX_PLAYERS) {
-				g->start_pos[start_pos_n].x = x;
-				g->start_pos[start_pos_n].y = y;
-				++start_pos_n;
-			}
-		}
-		else if(ch == '_') {
-			/* Ice */
-			tile->base = ' ';
-			tile->flags = 0;
-			struct object *o;
-			add_object_to_level(&o, g, &ice_class, x, y, 0, NULL);
-		}
-		else if(ch == '0') {
-			/* Boulder */
-			tile->base = ' ';
-			tile->flags = 0;
-			struct boulder *b;
-			if(boulder_new(&b, g, x, y) < 0) goto error;
-		}
-		else if(ch == '<' || ch == '>' || ch == '^' || ch == 'v') {
-			/* Pusher */
-			tile->base = ' ';
-			tile->flags = 0;
-			struct pusher *p;
-			if(pusher_new(&p, g, x, y, ch)) goto error;
-		}
-		else if(strchr(keys, ch)) {
-			/* Keys */
-			tile->base = ' ';
-			tile->flags = 0;
-			struct object *o;
-			add_object_to_level(&o, g, &key_class, x, y, 1,
-					(void *)(uintptr_t)ch);
-		}
-		else if(strchr(doors, ch)) {
-			/* Doors */
-			tile->base = ' ';
-			tile->flags = 0;
-			struct object *o;
-			add_object_to_level(&o, g, &door_class, x, y, 1,
-					(void *)(uintptr_t)ch);
-		}
-		else {
-			tile->base = ch;
-			tile->flags = 0;
-		}
+	for(i = 0; i < l->w * l->h; ++i) {
+		g->level[i].flags = 0;
+		g->level[i].base = l->bases[i];
+		g->level[i].objects = NULL;
+	}
 
-		++x;
+	for(i = 0; i < l->n_starts && i < MAX_PLAYERS; ++i) {
+		g->start_pos[i].x = l->starts[i].x;
+		g->start_pos[i].y = l->starts[i].y;
 	}
 
-level_done:
-	if(g->w == 0 || g->h == 0) {
-		g->state = GAME_FINISHED;
-		goto refresh;
+	for(i = 0; i < l->n_objects; ++i) {
+		if(add_level_object(g, &l->objects[i]) < 0) return -1;
 	}
 
 	for(i = 0; i < MAX_PLAYERS; ++i) {
@@ -568,8 +697,41 @@ level_done:
 
 	g->state = GAME_READYING;
 	start_countdown(g);
+	return 0;
+}
+
+/* Build level number g->level_n of the pack. */
+static int load_level(struct game *g)
+{
+	free_level(g);
+
+	g->level_flags |= LEVEL_LOADING;
+
+	double start = clock_sec();
+
+	if(g->level_n >= levelpack_count(g->pack)) {
+		g->state = GAME_FINISHED;
+		goto refresh;
+	}
+
+	struct level *l = levelpack_level(g->pack, g->level_n);
+	if(!l) {
+		fprintf(stderr, "Level %u is broken.\n", g->level_n);
+		goto error;
+	}
+	if(alloc_level(g, l->w, l->h) < 0) goto error;
+	g->image = l;
+	if(fill_level(g) < 0) goto error;
+
+	double t = clock_sec() - start;
+	pthread_mutex_lock(&stats_lock);
+	++stats.levels;
+	stats.bytes += l->pack_sz;
+	stats.seconds += t;
+	pthread_mutex_unlock(&stats_lock);
+
 refresh:
-	refresh_all(g);
+	refresh_later(g);
 	g->level_flags &= ~LEVEL_LOADING;
 	return 0;
 
@@ -579,6 +741,24 @@ error:
 	return -1;
 }
 
+/* Put the current level back the way it was loaded. Reuses the grid and
+ * the arena, so nothing is read or allocated. */
+static int restart_level(struct game *g)
+{
+	if(!g->image) return load_level(g);
+
+	g->level_flags |= LEVEL_LOADING;
+	clear_level(g);
+	if(fill_level(g) < 0) {
+		g->level_flags &= ~LEVEL_LOADING;
+		free_level(g);
+		return -1;
+	}
+	refresh_later(g);
+	g->level_flags &= ~LEVEL_LOADING;
+	return 0;
+}
+
 static int levelset(
 		unsigned freeing,
 		struct game *g,
@@ -586,12 +766,9 @@ static int levelset(
 {
 	if(freeing) goto free;
 
-	g->level_fd = open(level, O_RDONLY);
-	if(g->level_fd < 0) {
-		fprintf(stderr, strerror(errno));
-		goto e_open;
-	}
+	if(levelpack_new(&g->pack, level) < 0) goto e_levelpack;
 
+	g->level_n = 0;
 	if(load_level(g) < 0) goto e_level;
 
 	return 0;
@@ -599,14 +776,15 @@ static int levelset(
 free:
 	if(g->state != GAME_NONE) free_level(g);
 e_level:
-	close(g->level_fd);
-e_open:
+	levelpack_free(g->pack);
+	g->pack = NULL;
+e_levelpack:
 	return -1;
 }
 
 int game_load(struct game *g, char *level)
 {
-	if(g->state != GAME_NONE) {
+	if(g->pack) {
 		levelset(1, g, NULL);
 	}
 	return levelset(0, g, level);
@@ -628,13 +806,17 @@ struct player {
 
 	unsigned number;
 
-	/* The player's character if ingame. */
+	/* The player's character if ingame. Points to object. */
 	struct object *o;
+	struct object object;
 	char key;
-	int timer_fd;
-	void *fd_ptr;
+	void *timer;
 	int dx, dy;
 
+	/* Waiting for the next tick. */
+	unsigned n_inputs;
+	unsigned char inputs[MAX_INPUTS];
+
 	enum {
 		PLAYER_INITIALIZING = 1,
 		PLAYER_SLIDING = 2,
@@ -642,7 +824,7 @@ struct player {
 	} flags;
 };
 
-static int slide_callback(void *user, unsigned revents);
+static void slide_callback(void *user);
 static int player(
 		struct player *p,
 		struct player **p_out,
@@ -668,12 +850,10 @@ static int player(
 	p->o = NULL;
 	p->key = 0;
 	p->flags = PLAYER_INITIALIZING;
+	p->n_inputs = 0;
 
-	p->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
-	if(p->timer_fd < 0) goto e_timerfd;
-
-	p->fd_ptr = p->g->add_fd(p->g->user, p->timer_fd, 1, slide_callback, p);
-	if(!p->fd_ptr) goto e_add_fd;
+	p->timer = g->add_timer(g->user, slide_callback, p);
+	if(!p->timer) goto e_add_timer;
 
 	unsigned i;
 	for(i = 0; i < MAX_PLAYERS; ++i) {
@@ -693,16 +873,16 @@ found_number:
 	return 0;
 
 free:
-	object_free(p->o);
+	object_remove_2(p->o, 0);
+	/* The journal might refer to the player's object. */
+	p->g->n_journal = 0;
 e_add_object:
 	p->flags |= PLAYER_INITIALIZING;
 	update_invalid(p->g);
 	p->g->players[p->number] = NULL;
 e_number:
-	p->g->remove_fd(p->g->user, p->fd_ptr);
-e_add_fd:
-	close(p->timer_fd);
-e_timerfd:
+	p->g->remove_timer(p->g->user, p->timer);
+e_add_timer:
 	free(p);
 e_malloc:
 	return -1;
@@ -730,6 +910,8 @@ void player_free(struct player *p)
 static void refresh_all(struct game *g)
 {
 	unsigned i;
+	++g->frame;
+	compose_screen(g);
 	for(i = 0; i < MAX_PLAYERS; ++i) {
 		if(!g->players[i] || (g->players[i]->flags &
 				PLAYER_INITIALIZING)) continue;
@@ -740,6 +922,8 @@ static void refresh_all(struct game *g)
 static void update_coords_all(struct game *g, unsigned n, unsigned *coords)
 {
 	unsigned i;
+	++g->frame;
+	compose_tiles(g, n, coords);
 	for(i = 0; i < MAX_PLAYERS; ++i) {
 		if(!g->players[i] || (g->players[i]->flags &
 				PLAYER_INITIALIZING)) continue;
@@ -761,13 +945,9 @@ static void player_remove(struct object *o)
 	/* Don't free because players are persistent between levels. */
 	struct player *p = o->user;
 	p->key = '\0';
-	object_free(p->o);
 	p->o = NULL;
 	if(p->flags & PLAYER_SLIDING) {
-		struct itimerspec it = {};
-		it.it_value.tv_sec = 0;
-		it.it_value.tv_nsec = 0;
-		timerfd_settime(p->timer_fd, 0, &it, NULL);
+		p->g->set_timer(p->g->user, p->timer, 0, 0);
 	}
 	p->flags = 0;
 }
@@ -790,6 +970,7 @@ static void player_leave(struct object *o, struct object *o1)
 static void player_give_key(struct object *o, char key)
 {
 	struct player *p = o->user;
+	journal(p->g, JOURNAL_KEY, o, o->x, o->y, p->key);
 	p->key = key;
 }
 
@@ -806,12 +987,8 @@ static void player_slip(struct object *o, int dx, int dy)
 	p->dy = dy;
 	if(!(p->flags & PLAYER_SLIDING)) {
 		p->flags |= PLAYER_SLIDING;
-		struct itimerspec it = {};
-		it.it_interval.tv_sec = 0;
-		it.it_interval.tv_nsec = SLIDE_TIME_NSEC;
-		it.it_value = it.it_interval;
-		timerfd_settime(p->timer_fd, 0, &it, NULL);
-		p->flags |= PLAYER_SLIDING;
+		p->g->set_timer(p->g->user, p->timer, SLIDE_TIME_NSEC,
+				SLIDE_TIME_NSEC);
 	}
 	else {
 		p->flags |= PLAYER_CONTINUE_SLIDE;
@@ -823,22 +1000,17 @@ static int slide_callback1(struct player *p)
 {
 	player_move(p, p->dx, p->dy);
 	if(!(p->flags & PLAYER_CONTINUE_SLIDE)) {
-		struct itimerspec it = {};
-		it.it_value.tv_sec = 0;
-		it.it_value.tv_nsec = 0;
-		timerfd_settime(p->timer_fd, 0, &it, NULL);
+		p->g->set_timer(p->g->user, p->timer, 0, 0);
 		p->flags &= ~PLAYER_SLIDING;
 	}
 	p->flags &= ~PLAYER_CONTINUE_SLIDE;
 	return 0;
 }
 
-static int slide_callback(void *user, unsigned revents)
+static void slide_callback(void *user)
 {
 	struct player *p = user;
-	uint64_t n;
-	read(p->timer_fd, &n, sizeof n);
-	while(n--) slide_callback1(p);
+	slide_callback1(p);
 }
 
 static void player_draw(struct object *o, unsigned *ch_out, unsigned *fg_out,
@@ -863,33 +1035,53 @@ static struct class player_class = {
 static int add_player_to_game(struct player *p)
 {
 	if(p->g->start_pos[p->number].x == UINT_MAX) return 0;
-	int status = add_object_to_level(
-			&p->o,
+	add_object_to_level(
+			&p->object,
 			p->g,
 			&player_class,
 			p->g->start_pos[p->number].x,
 			p->g->start_pos[p->number].y,
 			10,
 			p);
+	p->o = &p->object;
 	update_invalid(p->g);
-	return status;
+	return 0;
+}
+
+static void remove_player_from_game(struct player *p)
+{
+	object_remove(p->o);
 }
 
 /*
  * Drawing the game
+ *
+ * The screen is composed of three layers. The playfield is the level and
+ * is shown while playing. Over it is the HUD, which holds the messages,
+ * the countdown and the status line. Over that is what each player sees
+ * alone, its own '@' in the status line, which player_get_tile() draws.
  */
 
-struct tileout {
-	struct player *p;
-	unsigned x;
-	unsigned y;
-	unsigned *ch_out;
-	unsigned *bg_out;
-	unsigned *fg_out;
-};
+static void hud_put(
+		struct game *g,
+		unsigned x,
+		unsigned y,
+		unsigned ch,
+		unsigned bg,
+		unsigned fg)
+{
+	if(x >= SCREEN_W || y >= SCREEN_H) return;
+	struct screen_cell *cell = &g->hud[y * SCREEN_W + x];
+	if(cell->ch == ch && cell->fg == fg && cell->bg == bg) return;
+	cell->ch = ch;
+	cell->fg = fg;
+	cell->bg = bg;
+	dirty_mark(&g->hud_dirty, x, y);
+}
 
+/* Fills x0 to x1, not including x1. */
 static void draw_string_left(
-		struct tileout *to,
+		struct game *g,
 		unsigned x0,
 		unsigned x1,
 		unsigned y,
@@ -897,21 +1089,15 @@ static void draw_string_left(
 		unsigned bg,
 		unsigned fg)
 {
-	if(to->y != y) return;
-	if(to->x < x0) return;
-	if(to->x > x1) return;
-	if(to->x - x0 >= strlen(str)) {
-		*to->ch_out = ' ';
+	unsigned len = strlen(str), x;
+	for(x = x0; x < x1; ++x) {
+		hud_put(g, x, y, x - x0 < len ? str[x - x0] : ' ', bg, fg);
 	}
-	else {
-		*to->ch_out = str[to->x - x0];
-	}
-	*to->bg_out = bg;
-	*to->fg_out = fg;
 }
 
+/* Fills x0 to x1, including x1. */
 static void draw_string_centered(
-		struct tileout *to,
+		struct game *g,
 		unsigned x0,
 		unsigned x1,
 		unsigned y,
@@ -919,54 +1105,39 @@ static void draw_string_centered(
 		unsigned bg,
 		unsigned fg)
 {
-	if(to->y != y) return;
-	if(to->x < x0) return;
-	if(to->x > x1) return;
-	unsigned len = strlen(str);
+	unsigned len = strlen(str), x;
 	int start = (x1 + x0 - len) / 2;
-	int str_offs = (to->x - x0) - start;
-	if(str_offs < 0 || str_offs >= len) {
-		*to->ch_out = ' ';
+	for(x = x0; x <= x1; ++x) {
+		int str_offs = (x - x0) - start;
+		hud_put(g, x, y, str_offs < 0 || str_offs >= len ? ' ' :
+				str[str_offs], bg, fg);
 	}
-	else {
-		*to->ch_out = str[str_offs];
-	}
-	*to->bg_out = bg;
-	*to->fg_out = fg;
 }
 
-void draw_player_status(
-		struct tileout *to,
-		struct player *p,
-		unsigned x0,
-		unsigned x1,
-		unsigned y)
-{
-	if(to->x < x0) return;
-	if(to->x >= x1) return;
-	if(to->y != y) return;
+static char status_msg[] = "Du är ";
+#define STATUS_LEN (sizeof status_msg - 1)
 
-	static char msg[] = "Du är ";
-	unsigned len = strlen(msg);
-	draw_string_left(to, x0, x1, y, msg, 0, 7);
-	if(to->x == x0 + len) {
-		*to->bg_out = 0;
-		*to->fg_out = get_player_color(p->number);
-		*to->ch_out = '@';
-	}
+/* Where the player status goes in the current state, if anywhere. */
+static unsigned get_status_line(
+		struct game *g,
+		unsigned *x0_out,
+		unsigned *x1_out,
+		unsigned *y_out)
+{
+	if(g->state == GAME_FINISHED) return 0;
+	unsigned playing = g->state == GAME_PLAYING;
+	*x0_out = playing ? 1 : 10;
+	*x1_out = playing ? 80 : 70;
+	*y_out = playing ? 22 : 15;
+	return 1;
 }
 
 static void draw_countdown(
-		struct tileout *to,
+		struct game *g,
 		unsigned x,
 		unsigned y,
 		unsigned n)
 {
-	if(to->x < x) return;
-	if(to->x >= x + 6) return;
-	if(to->y < y) return;
-	if(to->y >= y + 7) return;
-
 	char *nums[] = {
 		"  ##  "
 		" ###  "
@@ -990,36 +1161,102 @@ static void draw_countdown(
 		"##  ##"
 		" #### ",
 	};
-	*to->ch_out = nums[n][(to->y - y) * 6 + (to->x - x)];
-	*to->bg_out = 0;
-	*to->fg_out = 3;
+	unsigned i, j;
+	for(i = 0; i < 7; ++i) {
+		for(j = 0; j < 6; ++j)
+			hud_put(g, x + j, y + i, nums[n][i * 6 + j], 0, 3);
+	}
+}
+
+/* Draw the HUD of the current state from scratch. The player itself goes
+ * in the status line at status_x, status_y. */
+static void draw_hud(struct game *g)
+{
+	memset(g->hud, 0, sizeof g->hud);
+	dirty_clear(&g->hud_dirty);
+
+	if(g->state == GAME_NONE) {
+		draw_string_centered(g, 0, 80, 5, "Servern är inte aktiv",
+				0, 7);
+	}
+	else if(g->state == GAME_READYING) {
+		draw_countdown(g, 35, 4, g->countdown);
+	}
+	else if(g->state == GAME_FINISHED) {
+		draw_string_centered(g, 0, 80, 5, "Ni klarade det!",
+				0, 7);
+	}
+
+	unsigned x0, x1, y;
+	if(get_status_line(g, &x0, &x1, &y)) {
+		draw_string_left(g, x0, x1, y, status_msg, 0, 7);
+		g->status_x = x0 + STATUS_LEN;
+		g->status_y = y;
+	}
+	else {
+		g->status_x = UINT_MAX;
+		g->status_y = UINT_MAX;
+	}
+}
+
+/* Is the cell covered by the HUD? */
+static unsigned hud_covers(struct game *g, unsigned x, unsigned y)
+{
+	return g->hud[y * SCREEN_W + x].ch != 0;
 }
 
 static void draw_game(
-		struct tileout *to,
 		struct game *g,
-		struct player *p)
+		unsigned x,
+		unsigned y,
+		struct screen_cell *cell)
+{
+	unsigned ch = ' ', bg = 0, fg = 7;
+	if(x < g->w && y < g->h) {
+		ch = g->level[y * g->w + x].base;
+		struct object *o;
+		for(o = g->level[y * g->w + x].objects; o;
+				o = o->tile_next) {
+			o->class->draw(o, &ch, &fg, &bg);
+		}
+	}
+	cell->ch = ch;
+	cell->fg = fg;
+	cell->bg = bg;
+}
+
+static void compose_tile(struct game *g, unsigned x, unsigned y)
 {
-	unsigned x, y;
-	x = to->x;
-	y = to->y;
-	if(x >= g->w) return;
-	if(y >= g->h) return;
+	struct screen_cell *cell = &g->screen[y * SCREEN_W + x];
+	if(hud_covers(g, x, y)) {
+		*cell = g->hud[y * SCREEN_W + x];
+	}
+	else if(g->state == GAME_PLAYING) {
+		draw_game(g, x, y, cell);
+	}
+	else {
+		cell->ch = ' ';
+		cell->fg = 7;
+		cell->bg = 0;
+	}
+}
 
-	*to->ch_out = g->level[y * g->w + x].base;
-	*to->bg_out = 0;
-	*to->fg_out = 7;
+/* After the state changed. */
+static void compose_screen(struct game *g)
+{
+	unsigned x, y;
+	draw_hud(g);
+	dirty_clear(&g->invalid);
+	for(y = 0; y < SCREEN_H; ++y) {
+		for(x = 0; x < SCREEN_W; ++x) compose_tile(g, x, y);
+	}
+}
 
+static void compose_tiles(struct game *g, unsigned n, unsigned *coords)
+{
 	unsigned i;
-	if(g->level[y * g->w + x].flags & HAS_OBJECT) {
-		for(i = 0; i < g->n_objects; ++i) {
-			if(g->objects[i]->x == x && g->objects[i]->y == y) {
-				g->objects[i]->class->draw(g->objects[i],
-						to->ch_out, to->fg_out,
-						to->bg_out);
-			}
-		}
-	}
+	for(i = 0; i < n; ++i) compose_tile(g, coords[2 * i],
+			coords[2 * i + 1]);
 }
 
 void player_get_tile(
@@ -1031,34 +1268,41 @@ void player_get_tile(
 		unsigned *fg_out)
 {
 	struct game *g = p->g;
-	struct tileout to;
-	to.p = p;
-	to.x = x;
-	to.y = y;
-	to.ch_out = ch_out;
-	to.bg_out = bg_out;
-	to.fg_out = fg_out;
-	*ch_out = ' ';
-	*bg_out = 0;
-	*fg_out = 7;
-
-	if(g->state == GAME_NONE) {
-		draw_string_centered(&to, 0, 80, 5, "Servern är inte aktiv",
-				0, 7);
-		draw_player_status(&to, p, 10, 70, 15);
-	}
-	else if(g->state == GAME_READYING) {
-		draw_countdown(&to, 35, 4, g->countdown);
-		draw_player_status(&to, p, 10, 70, 15);
+	if(x == g->status_x && y == g->status_y) {
+		*ch_out = '@';
+		*bg_out = 0;
+		*fg_out = get_player_color(p->number);
+		return;
 	}
-	else if(g->state == GAME_PLAYING) {
-		draw_game(&to, g, p);
-		draw_player_status(&to, p, 1, 80, 22);
-	}
-	else if(g->state == GAME_FINISHED) {
-		draw_string_centered(&to, 0, 80, 5, "Ni klarade det!",
-				0, 7);
+	if(x >= SCREEN_W || y >= SCREEN_H) {
+		*ch_out = ' ';
+		*bg_out = 0;
+		*fg_out = 7;
+		return;
 	}
+
+	struct screen_cell *cell = &g->screen[y * SCREEN_W + x];
+	*ch_out = cell->ch;
+	*bg_out = cell->bg;
+	*fg_out = cell->fg;
+}
+
+unsigned long long player_get_frame(struct player *p)
+{
+	return p->g->frame;
+}
+
+unsigned player_get_private_tiles(
+		struct player *p,
+		unsigned *coords,
+		unsigned max)
+{
+	/* Only the player's own color in the status line. */
+	struct game *g = p->g;
+	if(!max || g->status_x == UINT_MAX) return 0;
+	coords[0] = g->status_x;
+	coords[1] = g->status_y;
+	return 1;
 }
 
 /*
@@ -1084,16 +1328,15 @@ static unsigned push(
 
 	if(src->flags & HAS_OBJECT) {
 		unsigned blocked = 0;
-		unsigned i;
-		for(i = 0; i < g->n_objects; ++i) {
-			struct object *o = g->objects[i];
-			if(o->x == x && o->y == y) {
-				if(o->class->push && !o->class->push(
-							o, pusher, dx, dy,
-							strength)) {
-					/* Player is blocked. */
-					blocked = 1;
-				}
+		struct object *o, *next;
+		/* Pushing might move or remove o. */
+		for(o = src->objects; o; o = next) {
+			next = o->tile_next;
+			if(o->class->push && !o->class->push(
+						o, pusher, dx, dy,
+						strength)) {
+				/* Player is blocked. */
+				blocked = 1;
 			}
 		}
 		if(blocked) return 0;
@@ -1113,27 +1356,27 @@ static void move_object(
 		*src = &g->level[y0 * g->w + x0],
 		*dst = &g->level[y1 * g->w + x1];
 
+	struct journal_entry *e = journal(g, JOURNAL_MOVE, o, x0, y0, 0);
+	if(e) {
+		e->x1 = x1;
+		e->y1 = y1;
+	}
+	unlink_from_tile(g, o);
 	o->x = x1;
 	o->y = y1;
+	link_to_tile(o);
 
-	src->flags &= ~HAS_OBJECT;
-	dst->flags |= HAS_OBJECT;
-
-	unsigned i;
-	for(i = 0; i < g->n_objects; ++i) {
-		struct object *o1 = g->objects[i];
-		if(o1->x == x0 && o1->y == y0) {
-			src->flags |= HAS_OBJECT;
-			if(o1->class->leave) o1->class->leave(o1, o);
-		}
+	struct object *o1, *next;
+	for(o1 = src->objects; o1; o1 = next) {
+		next = o1->tile_next;
+		if(o1->class->leave) o1->class->leave(o1, o);
 	}
-	for(i = 0; i < g->n_objects; ++i) {
-		struct object *o1 = g->objects[i];
-		if(o1->x == x1 && o1->y == y1) {
-			if(o1->class->enter) o1->class->enter(o1, o,
-					(int)x1 - (int)x0,
-					(int)y1 - (int)y0);
-		}
+	/* Includes o itself. Entering might remove o1. */
+	for(o1 = dst->objects; o1; o1 = next) {
+		next = o1->tile_next;
+		if(o1->class->enter) o1->class->enter(o1, o,
+				(int)x1 - (int)x0,
+				(int)y1 - (int)y0);
 	}
 
 	invalidate(g, x0, y0);
@@ -1167,7 +1410,6 @@ static void draw_key(struct object *o, unsigned *ch_out, unsigned *fg_out,
 }
 
 static struct class key_class = {
-	.remove = object_free,
 	.push = push_key,
 	.enter = enter_key,
 	.draw = draw_key,
@@ -1181,7 +1423,7 @@ static unsigned push_door(struct object *o, struct object *o1, int dx, int dy,
 		unsigned strength)
 {
 	char door = (char)(uintptr_t)o->user;
-	char key = keys[strchr(doors, door) - doors];
+	char key = tile_keys[strchr(tile_doors, door) - tile_doors];
 	if(o1->class->has_key(o1, key)) {
 		object_remove(o);
 		return 1;
@@ -1200,7 +1442,6 @@ static void draw_door(struct object *o, unsigned *ch_out, unsigned *fg_out,
 }
 
 static struct class door_class = {
-	.remove = object_free,
 	.push = push_door,
 	.draw = draw_door,
 };
@@ -1209,10 +1450,6 @@ static struct class door_class = {
  * Ice object
  */
 
-static void free_ice(struct object *o)
-{
-}
-
 static unsigned push_ice(struct object *o, struct object *o1, int dx, int dy,
 		unsigned strength)
 {
@@ -1237,7 +1474,6 @@ static void draw_ice(struct object *o, unsigned *ch_out, unsigned *fg_out,
 }
 
 static struct class ice_class = {
-	.remove = free_ice,
 	.push = push_ice,
 	.enter = enter_ice,
 	.leave = leave_ice,
@@ -1249,68 +1485,68 @@ static struct class ice_class = {
  */
 
 struct boulder {
-	int timer_fd;
-	void *fd_ptr;
+	/* Only while sliding. */
+	void *timer;
+	/* In game.sliding while sliding. */
+	struct boulder **prev_p, *next;
 	enum {
 		BOULDER_SLIDING = 1,
 		BOULDER_CONTINUE_SLIDING = 2,
 	} flags;
 	int dx, dy;
+	/* Whose step set it sliding. Its steps are that player's. */
+	unsigned player;
 	struct game *g;
-	struct object *o;
+	struct object o;
 };
 
-static int boulder_cb(void *user, unsigned revents);
-static int boulder(struct boulder *b, struct boulder **b_out, struct game *g,
-		unsigned x, unsigned y)
+/* Freed with the level. */
+static int boulder_new(struct boulder **b_out, struct game *g, unsigned x,
+		unsigned y)
 {
-	if(b) goto free;
-
-	b = malloc(sizeof *b);
-	if(!b) goto e_malloc;
+	struct boulder *b = arena_alloc(g->arena, sizeof *b);
+	if(!b) return -1;
 
+	b->timer = NULL;
 	b->flags = 0;
+	b->player = NO_PLAYER;
 	b->g = g;
-
-	b->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
-	if(b->timer_fd < 0) goto e_timerfd;
-
-	b->fd_ptr = g->add_fd(g->user, b->timer_fd, 1, boulder_cb, b);
-	if(!b->fd_ptr) goto e_add_fd;
-
-	if(add_object_to_level(&b->o, g, &bldr_class, x, y, 5, b) < 0) {
-		goto e_add_object;
-	}
+	add_object_to_level(&b->o, g, &bldr_class, x, y, 5, b);
 
 	*b_out = b;
 	return 0;
-
-free:
-	object_free(b->o);
-e_add_object:
-	b->g->remove_fd(b->g->user, b->fd_ptr);
-e_add_fd:
-	close(b->timer_fd);
-e_timerfd:
-	free(b);
-e_malloc:
-	return -1;
 }
 
-static int boulder_new(struct boulder **b_out, struct game *g, unsigned x,
-		unsigned y)
+static void boulder_cb(void *user);
+static int boulder_start(struct boulder *b)
 {
-	return boulder(NULL, b_out, g, x, y);
+	b->timer = b->g->add_timer(b->g->user, boulder_cb, b);
+	if(!b->timer) return -1;
+	b->g->set_timer(b->g->user, b->timer, SLIDE_TIME_NSEC,
+			SLIDE_TIME_NSEC);
+	b->flags |= BOULDER_SLIDING;
+
+	b->prev_p = &b->g->sliding;
+	b->next = b->g->sliding;
+	if(b->next) b->next->prev_p = &b->next;
+	b->g->sliding = b;
+	return 0;
 }
 
-static void boulder_free(struct boulder *b)
+static void boulder_stop(struct boulder *b)
 {
-	if(b) boulder(b, NULL, NULL, 0, 0);
+	if(!(b->flags & BOULDER_SLIDING)) return;
+	b->g->remove_timer(b->g->user, b->timer);
+	b->timer = NULL;
+	b->flags &= ~BOULDER_SLIDING;
+
+	*b->prev_p = b->next;
+	if(b->next) b->next->prev_p = b->prev_p;
 }
 
-static void free_boulder(struct object *o)
+static void boulder_remove(struct object *o)
 {
-	boulder_free(o->user);
+	boulder_stop(o->user);
 }
 
 static unsigned push_boulder(
@@ -1358,56 +1594,41 @@ static void boulder_slip(struct object *o, int dx, int dy)
 	struct boulder *b = o->user;
 	b->dx = dx;
 	b->dy = dy;
+	b->player = b->g->step_player;
 	if(b->flags & BOULDER_SLIDING) {
 		b->flags |= BOULDER_CONTINUE_SLIDING;
 	}
 	else {
-		struct itimerspec it;
-		it.it_interval.tv_sec = 0;
-		it.it_interval.tv_nsec = SLIDE_TIME_NSEC;
-		it.it_value = it.it_interval;
-		timerfd_settime(b->timer_fd, 0, &it, NULL);
-		b->flags |= BOULDER_SLIDING;
+		boulder_start(b);
 	}
 }
 
 static void boulder_cb1(struct boulder *b)
 {
-	unsigned x0 = b->o->x, y0 = b->o->y;
-	unsigned x1 = b->o->x + b->dx, y1 = b->o->y + b->dy;
-	if(push(b->o, x1, y1, b->dx, b->dy, 1)) {
-		move_object(b->o, x1, y1);
-		if(!(b->flags & BOULDER_CONTINUE_SLIDING)) {
-			struct itimerspec it = {};
-			it.it_value.tv_sec = 0;
-			it.it_value.tv_nsec = 0;
-			timerfd_settime(b->timer_fd, 0, &it, NULL);
-			b->flags &= ~BOULDER_SLIDING;
-		}
-		invalidate(b->o->g, x0, y0);
-		invalidate(b->o->g, x1, y1);
+	begin_step(b->g, b->player);
+	unsigned x0 = b->o.x, y0 = b->o.y;
+	unsigned x1 = b->o.x + b->dx, y1 = b->o.y + b->dy;
+	if(push(&b->o, x1, y1, b->dx, b->dy, 1)) {
+		move_object(&b->o, x1, y1);
+		if(!(b->flags & BOULDER_CONTINUE_SLIDING)) boulder_stop(b);
+		invalidate(b->g, x0, y0);
+		invalidate(b->g, x1, y1);
 	}
 	else {
-		struct itimerspec it = {};
-		it.it_value.tv_sec = 0;
-		it.it_value.tv_nsec = 0;
-		timerfd_settime(b->timer_fd, 0, &it, NULL);
-		b->flags &= ~BOULDER_SLIDING;
+		boulder_stop(b);
 	}
 	b->flags &= ~BOULDER_CONTINUE_SLIDING;
 	update_invalid(b->g);
 }
 
-static int boulder_cb(void *user, unsigned revents)
+static void boulder_cb(void *user)
 {
 	struct boulder *b = user;
-	uint64_t n;
-	read(b->timer_fd, &n, sizeof n);
-	while(n--) boulder_cb1(b);
+	boulder_cb1(b);
 }
 
 static struct class bldr_class = {
-	.remove = free_boulder,
+	.remove = boulder_remove,
 	.push = push_boulder,
 	.enter = enter_boulder,
 	.leave = leave_boulder,
@@ -1425,21 +1646,20 @@ struct pusher {
 	struct game *g;
 	char type;
 	int dx, dy;
-	struct object *o;
+	struct object o;
 };
 
 static struct class pusher_class;
 
-static int pusher(struct pusher *p, struct pusher **p_out, struct game *g,
-		int x, int y, char type)
+/* Freed with the level. */
+static int pusher_new(struct pusher **p_out, struct game *g, int x,
+		int y, char type)
 {
-	if(p) goto free;
-
-	p = malloc(sizeof *p);
+	struct pusher *p = arena_alloc(g->arena, sizeof *p);
 	if(!p) {
 		fprintf(stderr, "Malloc returned NULL at %s: %d.\n",
 				__FILE__, __LINE__);
-		goto e_malloc;
+		return -1;
 	}
 
 	p->g = g;
@@ -1452,35 +1672,10 @@ static int pusher(struct pusher *p, struct pusher **p_out, struct game *g,
 		type == 'v' ? 1 :
 		0;
 
-	if(add_object_to_level(&p->o, g, &pusher_class, x, y, 1, p)) {
-		goto e_add_object;
-	}
+	add_object_to_level(&p->o, g, &pusher_class, x, y, 1, p);
 
 	*p_out = p;
 	return 0;
-
-free:
-	object_free(p->o);
-e_add_object:
-	free(p);
-e_malloc:
-	return -1;
-}
-
-static int pusher_new(struct pusher **p_out, struct game *g, int x,
-		int y, char type)
-{
-	return pusher(NULL, p_out, g, x, y, type);
-}
-
-static void pusher_free(struct pusher *p)
-{
-	if(p) pusher(p, NULL, NULL, 0, 0, 0);
-}
-
-static void pusher_remove(struct object *o)
-{
-	pusher_free(o->user);
 }
 
 static void pusher_draw(struct object *o, unsigned *ch_out, unsigned *fg_out,
@@ -1498,7 +1693,6 @@ static void pusher_enter(struct object *o, struct object *o1, int dx, int dy)
 }
 
 static struct class pusher_class = {
-	.remove = pusher_remove,
 	.enter = pusher_enter,
 	.draw = pusher_draw,
 };
@@ -1506,17 +1700,90 @@ static struct class pusher_class = {
  * Player input
  */
 
-void player_key(struct player *p, unsigned char ch)
+/* Do two entries involve the same object or tile? */
+static unsigned entries_overlap(struct journal_entry *a,
+		struct journal_entry *b)
+{
+	if(a->type == JOURNAL_STEP || b->type == JOURNAL_STEP) return 0;
+	if(a->o == b->o) return 1;
+	if(a->type == JOURNAL_KEY || b->type == JOURNAL_KEY) return 0;
+	return (a->x == b->x && a->y == b->y) ||
+		(a->x == b->x1 && a->y == b->y1) ||
+		(a->x1 == b->x && a->y1 == b->y) ||
+		(a->x1 == b->x1 && a->y1 == b->y1);
+}
+
+/* A slide would continue from the wrong place. */
+static void stop_slide(struct object *o)
 {
-	if(ch == 'q' || ch == 'Q') {
-		p->stop(p->user);
+	if(o->class == &bldr_class) {
+		boulder_stop(o->user);
 	}
-	else if(ch == 'r' || ch == 'R') {
-		lseek(p->g->level_fd, p->g->level_offset, SEEK_SET);
-		load_level(p->g);
+	else if(o->class == &player_class) {
+		struct player *p = o->user;
+		if(!(p->flags & PLAYER_SLIDING)) return;
+		p->g->set_timer(p->g->user, p->timer, 0, 0);
+		p->flags &= ~(PLAYER_SLIDING | PLAYER_CONTINUE_SLIDE);
 	}
 }
 
+/* Undo the last step of p that changed something. If a later step of
+ * another player touched the same objects or tiles, undoing it would
+ * break that one, so nothing happens. */
+static void undo(struct player *p)
+{
+	struct game *g = p->g;
+	if(g->state != GAME_PLAYING) return;
+
+	/* The step is journal[start] up to journal[end]. */
+	unsigned start, end = g->n_journal;
+	for(start = g->n_journal; start--; ) {
+		struct journal_entry *e = &g->journal[start];
+		if(e->type != JOURNAL_STEP) continue;
+		if(e->player == p->number && end > start + 1) break;
+		end = start;
+	}
+	if(start == UINT_MAX) return;
+
+	unsigned i, j;
+	for(i = start + 1; i < end; ++i) {
+		for(j = end; j < g->n_journal; ++j) {
+			if(entries_overlap(&g->journal[i], &g->journal[j]))
+				return;
+		}
+	}
+
+	for(i = start + 1; i < end; ++i) stop_slide(g->journal[i].o);
+
+	g->level_flags |= LEVEL_UNDOING;
+	for(i = end; i-- > start + 1; ) {
+		struct journal_entry *e = &g->journal[i];
+		struct object *o = e->o;
+		if(e->type == JOURNAL_MOVE) {
+			invalidate(g, o->x, o->y);
+			unlink_from_tile(g, o);
+			o->x = e->x;
+			o->y = e->y;
+			link_to_tile(o);
+			invalidate(g, o->x, o->y);
+		}
+		else if(e->type == JOURNAL_REMOVE) {
+			o->g = g;
+			link_to_tile(o);
+			invalidate(g, o->x, o->y);
+		}
+		else if(e->type == JOURNAL_KEY) {
+			o->class->give_key(o, e->key);
+		}
+	}
+	g->level_flags &= ~LEVEL_UNDOING;
+
+	memmove(&g->journal[start], &g->journal[end],
+			(g->n_journal - end) * sizeof *g->journal);
+	g->n_journal -= end - start;
+	update_invalid(g);
+}
+
 static void player_move(struct player *p, int dx, int dy)
 {
 	if(p->g->state != GAME_PLAYING) return;
@@ -1534,12 +1801,14 @@ static void player_move(struct player *p, int dx, int dy)
 		y1 = p->o->y + dy;
 	struct tile *dst = &p->g->level[y1 * p->g->w + x1];
 
+	begin_step(p->g, p->number);
 	if(!push(p->o, x1, y1, dx, dy, 2)) return;
 
 	move_object(p->o, x1, y1);
 	update_invalid(p->g);
 
 	if(dst->base == '=') {
+		++p->g->level_n;
 		load_level(p->g);
 	}
 }
@@ -1550,22 +1819,80 @@ static void player_move_command(struct player *p, int dx, int dy)
 	player_move(p, dx, dy);
 }
 
+/* What a key does. */
+static void run_input(struct player *p, unsigned char ch)
+{
+	if(ch == 'u' || ch == 'U') {
+		undo(p);
+	}
+	else if(ch == 'r' || ch == 'R') {
+		if(!p->g->pack) return;
+		restart_level(p->g);
+	}
+	else if(ch == 'h') player_move_command(p, -1, 0);
+	else if(ch == 'l') player_move_command(p, 1, 0);
+	else if(ch == 'k') player_move_command(p, 0, -1);
+	else if(ch == 'j') player_move_command(p, 0, 1);
+}
+
+/* Run the input now or at the next tick. Inputs beyond MAX_INPUTS in one
+ * tick are dropped. */
+static void input(struct player *p, unsigned char ch)
+{
+	if(!p->g->tick_timer) run_input(p, ch);
+	else if(p->n_inputs < MAX_INPUTS) p->inputs[p->n_inputs++] = ch;
+}
+
+void player_key(struct player *p, unsigned char ch)
+{
+	if(ch == 'q' || ch == 'Q') p->stop(p->user);
+	else if(ch == 'u' || ch == 'U' || ch == 'r' || ch == 'R') input(p, ch);
+}
+
+/* Arrows are queued as the vi keys. */
 void player_left(struct player *p)
 {
-	player_move_command(p, -1, 0);
+	input(p, 'h');
 }
 
 void player_right(struct player *p)
 {
-	player_move_command(p, 1, 0);
+	input(p, 'l');
 }
 
 void player_up(struct player *p)
 {
-	player_move_command(p, 0, -1);
+	input(p, 'k');
 }
 
 void player_down(struct player *p)
 {
-	player_move_command(p, 0, 1);
+	input(p, 'j');
+}
+
+/* Run the inputs of all players, one from each in turn so that nobody
+ * goes first twice, and send what changed since the last tick. Timers
+ * change the world when they fire, but what they change is sent here
+ * too. */
+static void tick_f(void *user1)
+{
+	struct game *g = user1;
+	unsigned i, round, more = 1;
+	for(round = 0; more; ++round) {
+		more = 0;
+		for(i = 0; i < MAX_PLAYERS; ++i) {
+			struct player *p = g->players[i];
+			if(!p || round >= p->n_inputs) continue;
+			run_input(p, p->inputs[round]);
+			more = 1;
+		}
+	}
+	for(i = 0; i < MAX_PLAYERS; ++i) {
+		if(g->players[i]) g->players[i]->n_inputs = 0;
+	}
+	if(g->refresh_pending) {
+		g->refresh_pending = 0;
+		refresh_all(g);
+	}
+	else send_changes(g);
 }
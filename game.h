@@ -1,15 +1,32 @@
 struct game;
 
+/* With a tick_hz, player input is handled and screen updates are sent
+ * tick_hz times a second instead of as they happen. */
+
 int game_new(
 		struct game **game_out,
-		void *(*add_fd)(
+		void *(*add_timer)(
 			void *user,
-			int fd,
-			unsigned events,
-			int (*callback)(void *user1, unsigned revents),
+			void (*callback)(void *user1),
 			void *user1),
-		void (*remove_fd)(void *user, void *fd_ptr),
+		void (*set_timer)(
+			void *user,
+			void *timer,
+			unsigned long long value_nsec,
+			unsigned long long interval_nsec),
+		void (*remove_timer)(void *user, void *timer),
+		unsigned tick_hz,
 		void *user);
 void game_free(struct game *g);
 
+/* Totals over the levels built by all games. */
+struct game_stats {
+	unsigned long long levels;
+	/* Bytes of the pack they were built from. */
+	unsigned long long bytes;
+	double seconds;
+};
+
+void game_get_stats(struct game_stats *stats_out);
+
 int game_load(struct game *g, char *level);
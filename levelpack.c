@@ -0,0 +1,409 @@
+#include "levelpack.h"
+#include "tiles.h"
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/* The compiled format is native endian:
+ *   struct pack_header
+ *   unsigned long long offsets[n_levels + 1], the last one is the end
+ *   for each level, aligned to 8 bytes:
+ *     struct pack_level
+ *     struct level_item starts[n_starts]
+ *     struct level_item objects[n_objects]
+ *     char bases[w * h]
+ */
+#define PACK_MAGIC "TKLEVELS"
+#define PACK_VERSION 1
+
+struct pack_header {
+	char magic[8];
+	unsigned version;
+	unsigned n_levels;
+};
+
+struct pack_level {
+	unsigned w, h;
+	unsigned n_starts, n_objects;
+};
+
+struct levelpack {
+	char *map;
+	size_t map_sz;
+	unsigned compiled;
+
+	unsigned n_levels;
+	/* n_levels + 1 offsets into map. Points into map if compiled. */
+	const unsigned long long *offsets;
+	unsigned long long *text_offsets;
+
+	/* The level returned by levelpack_level(). */
+	struct level level;
+	/* Tiles and items of a parsed text level. */
+	void *buf;
+};
+
+/* What a character in the text format stands for. Returns 1 for objects
+ * and 2 for start positions. */
+static unsigned classify(char ch, char *base_out)
+{
+	*base_out = ' ';
+	switch(ch) {
+	case '.':
+		/* Ground */
+		return 0;
+	case '#':
+		/* Walls */
+	case '=':
+		/* Goal */
+		*base_out = ch;
+		return 0;
+	case '@':
+		return 2;
+	case '_':
+		/* Ice */
+	case '0':
+		/* Boulder */
+	case '<': case '>': case '^': case 'v':
+		/* Pushers */
+		return 1;
+	}
+	if(ch && (strchr(tile_keys, ch) || strchr(tile_doors, ch))) return 1;
+	*base_out = ch;
+	return 0;
+}
+
+struct level_size {
+	unsigned w, h, n_starts, n_objects;
+};
+
+/* Find where the level starting at offset ends and how big it is. Spaces
+ * and tabs are not part of the grid and a blank line ends the level. */
+static size_t measure_level(
+		char *map,
+		size_t offset,
+		size_t map_sz,
+		struct level_size *size)
+{
+	unsigned x = 0, y = 0;
+	unsigned was_newline = 0;
+	memset(size, 0, sizeof *size);
+
+	size_t i;
+	for(i = offset; i < map_sz; ++i) {
+		char ch = map[i];
+		if(ch == '\n') {
+			if(was_newline) {
+				++i;
+				break;
+			}
+			x = 0;
+			++y;
+			was_newline = 1;
+			continue;
+		}
+		was_newline = 0;
+		if(ch == ' ' || ch == '\t') continue;
+
+		char base;
+		unsigned kind = classify(ch, &base);
+		if(kind == 1) ++size->n_objects;
+		if(kind == 2) ++size->n_starts;
+
+		++x;
+		if(x > size->w) size->w = x;
+		size->h = y + 1;
+	}
+	return i;
+}
+
+static int index_text(struct levelpack *lp)
+{
+	unsigned n_alloc = 0;
+	size_t offset = 0;
+	lp->n_levels = 0;
+	lp->text_offsets = NULL;
+	while(1) {
+		if(lp->n_levels + 1 >= n_alloc) {
+			n_alloc = n_alloc ? 2 * n_alloc : 16;
+			unsigned long long *new_offsets = realloc(
+					lp->text_offsets,
+					sizeof *new_offsets * n_alloc);
+			if(!new_offsets) {
+				free(lp->text_offsets);
+				return -1;
+			}
+			lp->text_offsets = new_offsets;
+		}
+		lp->text_offsets[lp->n_levels] = offset;
+
+		/* An empty level ends the pack. */
+		struct level_size size;
+		size_t end = measure_level(lp->map, offset, lp->map_sz, &size);
+		if(!size.w) break;
+		++lp->n_levels;
+		offset = end;
+	}
+	lp->offsets = lp->text_offsets;
+	return 0;
+}
+
+static int index_compiled(struct levelpack *lp)
+{
+	struct pack_header *header = (void *)lp->map;
+	if(header->version != PACK_VERSION) return -1;
+	unsigned long long index_end = sizeof *header +
+		sizeof *lp->offsets * (header->n_levels + 1ULL);
+	if(index_end > lp->map_sz) return -1;
+
+	lp->n_levels = header->n_levels;
+	lp->offsets = (void *)(lp->map + sizeof *header);
+	lp->text_offsets = NULL;
+	return 0;
+}
+
+static int levelpack(
+		struct levelpack *lp,
+		struct levelpack **lp_out,
+		char *file)
+{
+	if(lp) goto free;
+
+	lp = malloc(sizeof *lp);
+	if(!lp) goto e_malloc;
+
+	lp->buf = NULL;
+
+	int fd = open(file, O_RDONLY);
+	if(fd < 0) goto e_open;
+
+	struct stat st;
+	if(fstat(fd, &st) < 0) goto e_fstat;
+
+	/* Levels are read straight from the page cache. */
+	lp->map = NULL;
+	lp->map_sz = st.st_size;
+	if(lp->map_sz) {
+		lp->map = mmap(NULL, lp->map_sz, PROT_READ, MAP_PRIVATE, fd,
+				0);
+		if(lp->map == MAP_FAILED) goto e_mmap;
+	}
+	close(fd);
+
+	lp->compiled = lp->map_sz >= sizeof(struct pack_header) &&
+		!memcmp(lp->map, PACK_MAGIC, 8);
+	if(lp->compiled && index_compiled(lp) < 0) goto e_index;
+	if(!lp->compiled && index_text(lp) < 0) goto e_index;
+
+	*lp_out = lp;
+	return 0;
+
+free:
+	free(lp->buf);
+	free(lp->text_offsets);
+e_index:
+	if(lp->map) munmap(lp->map, lp->map_sz);
+	free(lp);
+	return -1;
+
+e_mmap:
+e_fstat:
+	close(fd);
+e_open:
+	free(lp);
+e_malloc:
+	fprintf(stderr, "%s: %s\n", file, strerror(errno));
+	return -1;
+}
+
+int levelpack_new(struct levelpack **lp_out, char *file)
+{
+	return levelpack(NULL, lp_out, file);
+}
+
+void levelpack_free(struct levelpack *lp)
+{
+	if(lp) levelpack(lp, NULL, NULL);
+}
+
+unsigned levelpack_count(struct levelpack *lp)
+{
+	return lp->n_levels;
+}
+
+static struct level *parse_text(struct levelpack *lp, size_t offset)
+{
+	struct level *l = &lp->level;
+	struct level_size size;
+	size_t end = measure_level(lp->map, offset, lp->map_sz, &size);
+
+	/* Tiles and items in one allocation. */
+	free(lp->buf);
+	lp->buf = calloc(1, sizeof(struct level_item) *
+			(size.n_starts + size.n_objects) + size.w * size.h);
+	if(!lp->buf) return NULL;
+
+	struct level_item *starts = lp->buf;
+	struct level_item *objects = starts + size.n_starts;
+	char *bases = (char *)(objects + size.n_objects);
+	memset(bases, ' ', size.w * size.h);
+
+	l->w = size.w;
+	l->h = size.h;
+	l->bases = bases;
+	l->starts = starts;
+	l->objects = objects;
+	l->n_starts = 0;
+	l->n_objects = 0;
+	l->pack_sz = end - offset;
+
+	unsigned x = 0, y = 0;
+	size_t i;
+	for(i = offset; i < end; ++i) {
+		char ch = lp->map[i];
+		if(ch == '\n') {
+			x = 0;
+			++y;
+			continue;
+		}
+		if(ch == ' ' || ch == '\t') continue;
+
+		unsigned kind = classify(ch, &bases[y * l->w + x]);
+		if(kind) {
+			struct level_item *item = kind == 1 ?
+				&objects[l->n_objects++] :
+				&starts[l->n_starts++];
+			item->x = x;
+			item->y = y;
+			item->type = ch;
+		}
+		++x;
+	}
+	return l;
+}
+
+static unsigned check_items(struct level *l, const struct level_item *items,
+		unsigned n)
+{
+	unsigned i;
+	for(i = 0; i < n; ++i) {
+		if(items[i].x >= l->w || items[i].y >= l->h) return 0;
+	}
+	return 1;
+}
+
+static struct level *fixup_compiled(struct levelpack *lp,
+		unsigned long long offset, unsigned long long end)
+{
+	struct level *l = &lp->level;
+	if(offset % 8 || end > lp->map_sz || offset > end ||
+			end - offset < sizeof(struct pack_level)) return NULL;
+
+	struct pack_level *pl = (void *)(lp->map + offset);
+	unsigned long long sz = sizeof *pl + sizeof(struct level_item) *
+		((unsigned long long)pl->n_starts + pl->n_objects) +
+		(unsigned long long)pl->w * pl->h;
+	if(sz > end - offset) return NULL;
+
+	l->w = pl->w;
+	l->h = pl->h;
+	l->n_starts = pl->n_starts;
+	l->starts = (void *)(pl + 1);
+	l->n_objects = pl->n_objects;
+	l->objects = l->starts + l->n_starts;
+	l->bases = (void *)(l->objects + l->n_objects);
+	l->pack_sz = end - offset;
+
+	if(!check_items(l, l->starts, l->n_starts) ||
+			!check_items(l, l->objects, l->n_objects)) return NULL;
+	return l;
+}
+
+struct level *levelpack_level(struct levelpack *lp, unsigned n)
+{
+	if(n >= lp->n_levels) return NULL;
+	if(lp->compiled) {
+		return fixup_compiled(lp, lp->offsets[n], lp->offsets[n + 1]);
+	}
+	return parse_text(lp, lp->offsets[n]);
+}
+
+int levelpack_compile(char *src, char *dst)
+{
+	struct levelpack *lp;
+	if(levelpack_new(&lp, src) < 0) goto e_levelpack;
+
+	FILE *f = fopen(dst, "w");
+	if(!f) goto e_fopen;
+
+	struct pack_header header;
+	memset(&header, 0, sizeof header);
+	memcpy(header.magic, PACK_MAGIC, 8);
+	header.version = PACK_VERSION;
+	header.n_levels = lp->n_levels;
+	if(fwrite(&header, sizeof header, 1, f) != 1) goto e_write;
+
+	/* Index. Levels start after it, aligned to 8 bytes. */
+	unsigned long long offset = sizeof header +
+		sizeof offset * (lp->n_levels + 1ULL);
+	unsigned i;
+	for(i = 0; i <= lp->n_levels; ++i) {
+		offset = (offset + 7) / 8 * 8;
+		if(fwrite(&offset, sizeof offset, 1, f) != 1) goto e_write;
+		if(i == lp->n_levels) break;
+
+		struct level *l = levelpack_level(lp, i);
+		if(!l) goto e_write;
+		offset += sizeof(struct pack_level) +
+			sizeof(struct level_item) *
+			(l->n_starts + l->n_objects) + l->w * l->h;
+	}
+
+	/* The end of the last level is aligned like the starts, so the
+	 * file is padded after it too. */
+	static char zeros[8];
+	for(i = 0; i <= lp->n_levels; ++i) {
+		long pos = ftell(f);
+		if(pos % 8 && fwrite(zeros, 8 - pos % 8, 1, f) != 1) {
+			goto e_write;
+		}
+		if(i == lp->n_levels) break;
+
+		struct level *l = levelpack_level(lp, i);
+		if(!l) goto e_write;
+		struct pack_level pl = {
+			.w = l->w,
+			.h = l->h,
+			.n_starts = l->n_starts,
+			.n_objects = l->n_objects,
+		};
+		if(fwrite(&pl, sizeof pl, 1, f) != 1) goto e_write;
+		if(l->n_starts && fwrite(l->starts, sizeof *l->starts,
+				l->n_starts, f) != l->n_starts) goto e_write;
+		if(l->n_objects && fwrite(l->objects, sizeof *l->objects,
+				l->n_objects, f) != l->n_objects) goto e_write;
+		if(l->w && l->h && fwrite(l->bases, l->w * l->h, 1, f) != 1) {
+			goto e_write;
+		}
+	}
+
+	if(fclose(f)) goto e_fclose;
+	unsigned n_levels = lp->n_levels;
+	levelpack_free(lp);
+	return n_levels;
+
+e_write:
+	fclose(f);
+e_fclose:
+	unlink(dst);
+e_fopen:
+	levelpack_free(lp);
+e_levelpack:
+	return -1;
+}
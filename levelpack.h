@@ -0,0 +1,37 @@
+/*
+ * Level packs. Either the text format of the "levels" file or the
+ * compiled format written by levelpack_compile(), which starts with an
+ * index of the levels and is used straight from the mapped file.
+ */
+
+struct levelpack;
+
+/* A start position or an object. The type is the character used for it
+ * in the text format. */
+struct level_item {
+	unsigned x, y;
+	char type;
+};
+
+struct level {
+	unsigned w, h;
+	/* Base character of each tile, row by row. */
+	const char *bases;
+	unsigned n_starts;
+	const struct level_item *starts;
+	unsigned n_objects;
+	const struct level_item *objects;
+	/* Bytes the level takes up in the pack. */
+	unsigned long pack_sz;
+};
+
+int levelpack_new(struct levelpack **lp_out, char *file);
+void levelpack_free(struct levelpack *lp);
+
+unsigned levelpack_count(struct levelpack *lp);
+/* Valid until the next call. NULL if the level is broken. */
+struct level *levelpack_level(struct levelpack *lp, unsigned n);
+
+/* Write the levels in src to dst in the compiled format. Returns the
+ * number of levels or -1. */
+int levelpack_compile(char *src, char *dst);
@@ -17,6 +17,8 @@ struct list {
 
 struct listener {
 	struct game *g;
+	/* Frames shared by the connections to the game. */
+	struct connection_cache *cache;
 	void *(*add_fd)(
 		void *user,
 		int fd,
@@ -24,6 +26,13 @@ struct listener {
 		int (*callback)(void *user1, unsigned revents),
 		void *user1);
 	void (*remove_fd)(void *user, void *fd_ptr);
+	int (*accept_fd)(void *user, void *fd_ptr, int fd);
+	ssize_t (*recv_fd)(
+		void *user,
+		void *fd_ptr,
+		int fd,
+		void *buf,
+		size_t len);
 	void *fd_ptr;
 	void *user;
 	void (*stop_callback)(void *user);
@@ -46,6 +55,7 @@ static int listener(
 		struct listener *l,
 		struct listener **l_out,
 		int port,
+		unsigned reuse_port,
 		struct game *g,
 		void *(*add_fd)(
 			void *user,
@@ -54,6 +64,13 @@ static int listener(
 			int (*callback)(void *user1, unsigned revents),
 			void *user1),
 		void (*remove_fd)(void *user, void *fd_ptr),
+		int (*accept_fd)(void *user, void *fd_ptr, int fd),
+		ssize_t (*recv_fd)(
+			void *user,
+			void *fd_ptr,
+			int fd,
+			void *buf,
+			size_t len),
 		void *user)
 {
 	if(l) goto free;
@@ -64,6 +81,8 @@ static int listener(
 	l->g = g;
 	l->add_fd = add_fd;
 	l->remove_fd = remove_fd;
+	l->accept_fd = accept_fd;
+	l->recv_fd = recv_fd;
 	l->user = user;
 	l->flags = 0;
 	l->stop_callback = NULL;
@@ -71,11 +90,19 @@ static int listener(
 	l->stopping_connections = NULL;
 	l->stopped_connections = NULL;
 
+	if(connection_cache_new(&l->cache) < 0) goto e_cache;
+
 	/* Create a socket. */
 	l->socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK
 			| SOCK_CLOEXEC, 0);
 	if(l->socket < 0) goto e_socket;
 
+	/* Let listeners in other threads share the port. The kernel spreads
+	 * incoming connections between them. */
+	int one = 1;
+	if(reuse_port && setsockopt(l->socket, SOL_SOCKET, SO_REUSEPORT,
+				&one, sizeof one) < 0) goto e_setsockopt;
+
 	/* Bind socket to port and listen to it. */
 	struct sockaddr_in addr;
 	memset(&addr, 0, sizeof addr);
@@ -90,7 +117,7 @@ static int listener(
 	if(listen(l->socket, 5) < 0) goto e_listen;
 
 	/* Wait for it. */
-	l->fd_ptr = l->add_fd(l->user, l->socket, 1, incoming, l);
+	l->fd_ptr = l->add_fd(l->user, l->socket, 1 | 8, incoming, l);
 	if(!l->fd_ptr) goto e_add_fd;
 
 	*l_out = l;
@@ -114,8 +141,11 @@ free:
 e_add_fd:
 e_listen:
 e_bind:
+e_setsockopt:
 	if(!(l->flags & FD_REMOVED)) close(l->socket);
 e_socket:
+	connection_cache_free(l->cache);
+e_cache:
 	free(l);
 e_malloc:
 	return -1;
@@ -124,6 +154,7 @@ e_malloc:
 int listener_new(
 		struct listener **listener_out,
 		int port,
+		unsigned reuse_port,
 		struct game *g,
 		void *(*add_fd)(
 			void *user,
@@ -132,14 +163,22 @@ int listener_new(
 			int (*callback)(void *user1, unsigned revents),
 			void *user1),
 		void (*remove_fd)(void *user, void *fd_ptr),
+		int (*accept_fd)(void *user, void *fd_ptr, int fd),
+		ssize_t (*recv_fd)(
+			void *user,
+			void *fd_ptr,
+			int fd,
+			void *buf,
+			size_t len),
 		void *user)
 {
-	return listener(NULL, listener_out, port, g, add_fd, remove_fd, user);
+	return listener(NULL, listener_out, port, reuse_port, g, add_fd,
+			remove_fd, accept_fd, recv_fd, user);
 }
 
 void listener_free(struct listener *l)
 {
-	if(l) listener(l, NULL, 0, NULL, NULL, NULL, NULL);
+	if(l) listener(l, NULL, 0, 0, NULL, NULL, NULL, NULL, NULL, NULL);
 }
 
 static void connection_was_stopped(void *user)
@@ -234,24 +273,37 @@ static void remove_fd(void *user, void *fd_ptr)
 	l->remove_fd(l->user, fd_ptr);
 }
 
+static ssize_t recv_fd(
+		void *user,
+		void *fd_ptr,
+		int fd,
+		void *buf,
+		size_t len)
+{
+	struct list *lst = user;
+	struct listener *l = lst->l;
+	return l->recv_fd(l->user, fd_ptr, fd, buf, len);
+}
+
 static void stop_request(void *user)
 {
 	struct list *lst = user;
 	stop_connection(lst);
 }
 
-static int incoming(void *user, unsigned revents)
+static int add_connection(struct listener *l, int fd)
 {
-	struct listener *l = user;
 	struct list *lst = malloc(sizeof *lst);
 	if(!lst) goto e_malloc;
 
 	lst->l = l;
 	if(connection_new(&lst->connection,
 				l->g,
-				l->socket,
+				l->cache,
+				fd,
 				add_fd,
 				remove_fd,
+				recv_fd,
 				stop_request,
 				lst) < 0) goto e_connection;
 
@@ -265,5 +317,18 @@ static int incoming(void *user, unsigned revents)
 e_connection:
 	free(lst);
 e_malloc:
+	return -1;
+}
+
+static int incoming(void *user, unsigned revents)
+{
+	struct listener *l = user;
+
+	/* Take every connection that is waiting. */
+	while(1) {
+		int fd = l->accept_fd(l->user, l->fd_ptr, l->socket);
+		if(fd < 0) break;
+		if(add_connection(l, fd) < 0) close(fd);
+	}
 	return 0;
 }
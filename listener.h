@@ -1,9 +1,12 @@
+#include <sys/types.h>
+
 struct listener;
 struct game;
 
 int listener_new(
 		struct listener **listener_out,
 		int port,
+		unsigned reuse_port,
 		struct game *g,
 		void *(*add_fd)(
 			void *user,
@@ -12,6 +15,13 @@ int listener_new(
 			int (*callback)(void *user1, unsigned revents),
 			void *user1),
 		void (*remove_fd)(void *user, void *fd_ptr),
+		int (*accept_fd)(void *user, void *fd_ptr, int fd),
+		ssize_t (*recv_fd)(
+			void *user,
+			void *fd_ptr,
+			int fd,
+			void *buf,
+			size_t len),
 		void *user);
 void listener_stop(struct listener *l, void (*callback)(void *user));
 void listener_free(struct listener *l);
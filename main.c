@@ -1,6 +1,10 @@
+#define _GNU_SOURCE
 #include "game.h"
 #include "console.h"
 #include "listener.h"
+#include "uring.h"
+#include "timer.h"
+#include "stack.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
@@ -12,18 +16,57 @@
 #include <netinet/in.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 
+/* Default number of events fetched per epoll_wait(). */
+#define MAX_EVENTS 64
+
+/* Size of the submission queue when using io_uring. */
+#define URING_ENTRIES 256
+
+struct fd_struct;
 struct main_data {
+	struct main_data *reactors;
+	unsigned n_reactors;
+	pthread_t thread;
+
+	int port;
+	unsigned use_uring;
+	/* Game ticks per second, 0 for none. */
+	unsigned tick_hz;
+	struct game *game;
+
+	/* Pointers to struct message. */
+	int msg_pipe[2];
+	void *msg_fd_ptr;
+
 	int epoll_fd;
-	struct fd_list *fd_list;
 	unsigned to_quit;
 	unsigned objects_stopping;
+
+	/* Buffer for epoll_wait(). */
+	unsigned max_events;
+	struct epoll_event *events;
+
+	/* Unregistered fd_structs that may still be referenced by events in
+	 * the batch being dispatched. Freed by free_dead_fds(). */
+	struct fd_struct *dead;
+
+	/* Used instead of epoll if not NULL. */
+	struct uring *uring;
+
+	struct timers *timers;
+
+	unsigned long long n_syscalls, n_events;
 };
 
 struct fd_struct {
 	int fd;
+	/* NULL once unregistered. */
 	int (*callback)(void *user1, unsigned revents);
 	void *user1;
+	struct fd_struct *next_dead;
 };
 
 
@@ -51,6 +94,7 @@ static int fd_struct(
 		((events & 2) ? EPOLLOUT : 0) |
 		((events & 4) ? EPOLLET : 0);
 	ev.data.ptr = s;
+	++data->n_syscalls;
 	if(epoll_ctl(data->epoll_fd, EPOLL_CTL_ADD, s->fd, &ev) < 0)
 		goto e_epoll_ctl;
 
@@ -58,7 +102,14 @@ static int fd_struct(
 	return 0;
 
 free:
+	++data->n_syscalls;
 	epoll_ctl(data->epoll_fd, EPOLL_CTL_DEL, s->fd, NULL);
+	/* A later event in the current batch may still point to s, so leave
+	 * a tombstone instead of freeing it right away. */
+	s->callback = NULL;
+	s->next_dead = data->dead;
+	data->dead = s;
+	return -1;
 e_epoll_ctl:
 	free(s);
 e_malloc:
@@ -72,6 +123,9 @@ static void *reg_fd(
 		int (*f)(void *user1, unsigned revents),
 		void *user1)
 {
+	struct main_data *data = user;
+	if(data->uring) return uring_add_fd(data->uring, fd, events, f, user1);
+
 	struct fd_struct *s;
 	if(fd_struct(NULL, &s, user, fd, events, f, user1) < 0) return NULL;
 	return s;
@@ -79,22 +133,160 @@ static void *reg_fd(
 
 static void unreg_fd(void *user, void *fd_ret)
 {
-	fd_struct(fd_ret, NULL, user, 0, 0, NULL, NULL);
+	struct main_data *data = user;
+	if(data->uring) uring_remove_fd(data->uring, fd_ret);
+	else fd_struct(fd_ret, NULL, user, 0, 0, NULL, NULL);
+}
+
+/* Counted like the epoll calls. With io_uring the work is done within
+ * io_uring_enter(). */
+static int accept_fd(void *user, void *fd_ptr, int fd)
+{
+	struct main_data *data = user;
+	if(data->uring) return uring_accept(data->uring, fd_ptr);
+	++data->n_syscalls;
+	return accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
+static ssize_t recv_fd(void *user, void *fd_ptr, int fd, void *buf,
+		size_t len)
+{
+	struct main_data *data = user;
+	if(data->uring) return uring_recv(data->uring, fd_ptr, buf, len);
+	++data->n_syscalls;
+	return read(fd, buf, len);
+}
+
+static void *add_timer(void *user, void (*f)(void *user1), void *user1)
+{
+	struct main_data *data = user;
+	return timers_add(data->timers, f, user1);
+}
+
+static void set_timer(
+		void *user,
+		void *timer,
+		unsigned long long value_nsec,
+		unsigned long long interval_nsec)
+{
+	struct main_data *data = user;
+	timers_set(data->timers, timer, value_nsec, interval_nsec);
+}
+
+static void remove_timer(void *user, void *timer)
+{
+	struct main_data *data = user;
+	timers_remove(data->timers, timer);
+}
+
+static void free_dead_fds(struct main_data *data)
+{
+	while(data->dead) {
+		struct fd_struct *s = data->dead;
+		data->dead = s->next_dead;
+		free(s);
+	}
 }
 
 static int event_on_fd(struct main_data *data, struct epoll_event *ev)
 {
 	struct fd_struct *s = ev->data.ptr;
+	/* Removed by an earlier callback in this batch. */
+	if(!s->callback) return 0;
+	++data->n_events;
 	return s->callback(s->user1,
 			(ev->events & EPOLLIN ? 1 : 0) |
 			(ev->events & EPOLLOUT ? 2 : 0) |
 			(ev->events & EPOLLERR ? 4 : 0));
 }
 
+/* Wait for events or the next timer and dispatch all of them. */
+static int wait_events(struct main_data *data)
+{
+	int timeout = timers_timeout(data->timers);
+	if(data->uring) {
+		if(uring_wait(data->uring, timeout) < 0) return -1;
+		timers_run(data->timers);
+		return 0;
+	}
+
+	++data->n_syscalls;
+	int n = epoll_wait(data->epoll_fd, data->events, data->max_events,
+			timeout);
+	/* Also interrupted by io_uring cleaning up after a failed setup. */
+	if(n < 0 && errno == EINTR) n = 0;
+	if(n < 0) return -1;
+
+	int i;
+	for(i = 0; i < n; ++i) {
+		if(event_on_fd(data, &data->events[i]) < 0) return -1;
+	}
+	free_dead_fds(data);
+	timers_run(data->timers);
+	return 0;
+}
+
+/*
+ * Reactors. Each one runs the loop above in its own thread with its own
+ * game and listener. Other threads only talk to it through messages.
+ */
+
+struct message {
+	/* NULL to quit. */
+	void (*f)(struct game *g, void *arg);
+	char arg[];
+};
+
+static void post_message(
+		struct main_data *data,
+		void (*f)(struct game *g, void *arg),
+		void *arg,
+		unsigned arg_sz)
+{
+	struct message *msg = malloc(sizeof *msg + arg_sz);
+	if(!msg) return;
+	msg->f = f;
+	memcpy(msg->arg, arg, arg_sz);
+	if(write(data->msg_pipe[1], &msg, sizeof msg) != sizeof msg) free(msg);
+}
+
+static int message_f(void *user, unsigned revents)
+{
+	struct main_data *data = user;
+	struct message *msg;
+	while(read(data->msg_pipe[0], &msg, sizeof msg) == sizeof msg) {
+		if(!msg->f) data->to_quit = 1;
+		else msg->f(data->game, msg->arg);
+		free(msg);
+	}
+	return 0;
+}
+
+/* Run f on the game of every reactor, in the thread of that reactor. */
+static void for_each_game(
+		void *user,
+		void (*f)(struct game *g, void *arg),
+		void *arg,
+		unsigned arg_sz)
+{
+	struct main_data *data = user;
+	unsigned i;
+	for(i = 0; i < data->n_reactors; ++i) {
+		struct main_data *r = &data->reactors[i];
+		if(r == data) f(data->game, arg);
+		else post_message(r, f, arg, arg_sz);
+	}
+}
+
 static void quit_req(void *user)
 {
 	struct main_data *data = user;
-	data->to_quit = 1;
+	unsigned i;
+	for(i = 0; i < data->n_reactors; ++i) {
+		struct main_data *r = &data->reactors[i];
+		if(r == data) data->to_quit = 1;
+		else post_message(r, NULL, NULL, 0);
+	}
 }
 
 static void quit_notify(void *user)
@@ -103,55 +295,170 @@ static void quit_notify(void *user)
 	--data->objects_stopping;
 }
 
-int main(int argc, char **argv)
+static int run_reactor(struct main_data *data)
 {
 	int err = 1;
 
-	int port = argc == 2 ? atoi(argv[1]) : 23;
+	data->events = malloc(sizeof *data->events * data->max_events);
+	if(!data->events) goto e_malloc;
 
-	struct main_data data;
-	data.to_quit = 0;
-	data.fd_list = NULL;
+	data->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(data->epoll_fd < 0) goto e_epoll_create;
 
-	data.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
-	if(data.epoll_fd < 0) goto e_epoll_create;
+	if(timers_new(&data->timers) < 0) goto e_timers;
 
-	struct game *game;
-	if(game_new(&game, reg_fd, unreg_fd, &data) < 0) goto e_game_new;
+	if(data->use_uring && uring_new(&data->uring, URING_ENTRIES) < 0) {
+		fprintf(stderr, "Could not set up io_uring: %s. Using epoll.\n",
+				strerror(errno));
+		data->uring = NULL;
+	}
+
+	data->msg_fd_ptr = reg_fd(data, data->msg_pipe[0], 1, message_f, data);
+	if(!data->msg_fd_ptr) goto e_msg_fd;
+
+	if(game_new(&data->game, add_timer, set_timer, remove_timer,
+				data->tick_hz, data) < 0) goto e_game_new;
 
 	struct listener *listener;
-	if(listener_new(&listener, port, game, reg_fd, unreg_fd, &data) < 0)
+	if(listener_new(&listener, data->port, data->n_reactors > 1,
+				data->game, reg_fd, unreg_fd, accept_fd,
+				recv_fd, data) < 0)
 		goto e_listener_new;
 
-	struct console *console;
-	if(console_new(&console, game, reg_fd, unreg_fd, quit_req, &data) < 0)
+	/* The console belongs to the first reactor. */
+	struct console *console = NULL;
+	if(data == data->reactors && console_new(&console, for_each_game,
+				reg_fd, unreg_fd, quit_req, data) < 0)
 		goto e_console_new;
 
-	while(!data.to_quit) {
-		struct epoll_event ev;
-		if(epoll_wait(data.epoll_fd, &ev, 1, -1) < 0) goto e_event;
-		if(event_on_fd(&data, &ev) < 0) goto e_event;
+	while(!data->to_quit) {
+		if(wait_events(data) < 0) goto e_event;
 	}
 
-	data.objects_stopping = 1;
+	data->objects_stopping = 1;
 	listener_stop(listener, quit_notify);
 
-	while(data.objects_stopping) {
-		struct epoll_event ev;
-		if(epoll_wait(data.epoll_fd, &ev, 1, -1) < 0) goto e_event;
-		if(event_on_fd(&data, &ev) < 0) goto e_event;
+	while(data->objects_stopping) {
+		if(wait_events(data) < 0) goto e_event;
 	}
 
 	err = 0;
 
+	if(data->uring) {
+		uring_get_stats(data->uring, &data->n_syscalls,
+				&data->n_events);
+	}
+	if(data->n_reactors > 1) {
+		printf("Reactor %u: ", (unsigned)(data - data->reactors));
+	}
+	printf("%s: %llu syscalls for %llu events.\n",
+			data->uring ? "io_uring" : "epoll",
+			data->n_syscalls, data->n_events);
+
 e_event:
 	console_free(console);
 e_console_new:
 	listener_free(listener);
 e_listener_new:
-	game_free(game);
+	game_free(data->game);
 e_game_new:
-	close(data.epoll_fd);
+	unreg_fd(data, data->msg_fd_ptr);
+e_msg_fd:
+	free_dead_fds(data);
+	uring_free(data->uring);
+	timers_free(data->timers);
+e_timers:
+	close(data->epoll_fd);
 e_epoll_create:
+	free(data->events);
+e_malloc:
+	return err;
+}
+
+static void *reactor_thread(void *user)
+{
+	struct main_data *data = user;
+	if(run_reactor(data)) {
+		/* Take the whole server down, like reactor 0 would. */
+		fprintf(stderr, "Reactor %u failed.\n",
+				(unsigned)(data - data->reactors));
+		quit_req(data);
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	int err = 1;
+
+	unsigned max_events = MAX_EVENTS, use_uring = 0, n_reactors = 1;
+	unsigned tick_hz = 0;
+	int opt;
+	while((opt = getopt(argc, argv, "b:r:t:u")) != -1) {
+		if(opt == 'b' && atoi(optarg) > 0) {
+			max_events = atoi(optarg);
+		}
+		else if(opt == 'r' && atoi(optarg) > 0 &&
+				atoi(optarg) <= 1000) {
+			tick_hz = atoi(optarg);
+		}
+		else if(opt == 't' && atoi(optarg) > 0) {
+			n_reactors = atoi(optarg);
+		}
+		else if(opt == 'u') {
+			use_uring = 1;
+		}
+		else {
+			fprintf(stderr, "Usage: %s [-u] [-b EVENTS] [-r HZ] "
+					"[-t THREADS] [PORT]\n", argv[0]);
+			goto e_args;
+		}
+	}
+	int port = optind < argc ? atoi(argv[optind]) : 23;
+
+	struct main_data *reactors = calloc(n_reactors, sizeof *reactors);
+	if(!reactors) goto e_calloc;
+
+	unsigned i;
+	for(i = 0; i < n_reactors; ++i) {
+		struct main_data *data = &reactors[i];
+		data->reactors = reactors;
+		data->n_reactors = n_reactors;
+		data->port = port;
+		data->max_events = max_events;
+		data->use_uring = use_uring;
+		data->tick_hz = tick_hz;
+		if(pipe(data->msg_pipe) < 0) goto e_pipe;
+		fcntl(data->msg_pipe[0], F_SETFL, O_NONBLOCK);
+	}
+
+	for(i = 1; i < n_reactors; ++i) {
+		if(pthread_create(&reactors[i].thread, NULL, reactor_thread,
+					&reactors[i])) {
+			fprintf(stderr, "Could not start reactor %u.\n", i);
+			goto e_thread;
+		}
+	}
+
+	err = run_reactor(&reactors[0]);
+
+e_thread:
+	/* Also stop the others if we failed. Reactors that were never
+	 * started only have the message freed below. */
+	quit_req(&reactors[0]);
+	while(i-- > 1) pthread_join(reactors[i].thread, NULL);
+	i = n_reactors;
+e_pipe:
+	while(i--) {
+		struct message *msg;
+		while(read(reactors[i].msg_pipe[0], &msg, sizeof msg) ==
+				sizeof msg) free(msg);
+		close(reactors[i].msg_pipe[0]);
+		close(reactors[i].msg_pipe[1]);
+	}
+	free(reactors);
+	stack_drain_pool();
+e_calloc:
+e_args:
 	return err;
 }
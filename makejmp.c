@@ -1,8 +1,193 @@
 #include "makejmp.h"
-#include <ucontext.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+/* Unless built with -DMAKEJMP_SETJMP, x86-64 and aarch64 use a context
+ * switch that only saves the callee-saved registers and the floating
+ * point control state on the stack being left and keeps the stack pointer
+ * in the jmp_buf. Other platforms use setjmp()/longjmp() with a ucontext
+ * bootstrap. */
+#if !defined(MAKEJMP_SETJMP) && \
+	(defined(__x86_64__) || defined(__aarch64__))
+#define MAKEJMP_ASM
+#endif
+
+#ifdef MAKEJMP_ASM
+
+/* Saves registers, stores the stack pointer in *from_sp and continues on
+ * to_sp. */
+void makejmp_switch(void **from_sp, void *to_sp);
+/* Where a new context starts. Calls f(user) from saved registers. */
+extern char makejmp_start[];
+
+#if defined(__x86_64__)
+
+__asm__(
+	".text\n"
+	".globl makejmp_switch\n"
+	".hidden makejmp_switch\n"
+	".type makejmp_switch, @function\n"
+	"makejmp_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size makejmp_switch, .-makejmp_switch\n"
+	"\n"
+	".globl makejmp_start\n"
+	".hidden makejmp_start\n"
+	".type makejmp_start, @function\n"
+	"makejmp_start:\n"
+	"	movq %r13, %rdi\n"
+	"	callq *%r12\n"
+	"	callq abort@PLT\n"
+	".size makejmp_start, .-makejmp_start\n"
+);
+
+/* MXCSR and the x87 control word, r15, r14, r13, r12, rbx, rbp and the
+ * return address. */
+#define FRAME_WORDS 8
+#define FRAME_FP 0
+#define FRAME_F 4
+#define FRAME_USER 3
+#define FRAME_RET 7
+/* So that the stack is 16 byte aligned at the call in makejmp_start. */
+#define FRAME_PAD 2
+
+/* A new context starts with the rounding and exception masks of the one
+ * that made it. */
+static void *fp_state(void)
+{
+	uint32_t mxcsr;
+	uint16_t cw;
+	__asm__("stmxcsr %0" : "=m"(mxcsr));
+	__asm__("fnstcw %0" : "=m"(cw));
+	return (void *)((uintptr_t)cw << 32 | mxcsr);
+}
+
+#elif defined(__aarch64__)
+
+__asm__(
+	".text\n"
+	".globl makejmp_switch\n"
+	".hidden makejmp_switch\n"
+	".type makejmp_switch, %function\n"
+	"makejmp_switch:\n"
+	"	sub sp, sp, #176\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mrs x2, fpcr\n"
+	"	str x2, [sp, #160]\n"
+	"	mov x2, sp\n"
+	"	str x2, [x0]\n"
+	"	mov sp, x1\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	ldr x2, [sp, #160]\n"
+	"	msr fpcr, x2\n"
+	"	add sp, sp, #176\n"
+	"	ret\n"
+	".size makejmp_switch, .-makejmp_switch\n"
+	"\n"
+	".globl makejmp_start\n"
+	".hidden makejmp_start\n"
+	".type makejmp_start, %function\n"
+	"makejmp_start:\n"
+	"	mov x0, x20\n"
+	"	blr x19\n"
+	"	bl abort\n"
+	".size makejmp_start, .-makejmp_start\n"
+);
+
+/* x19-x30, d8-d15 and FPCR, padded to 16 bytes. Returns through x30. */
+#define FRAME_WORDS 22
+#define FRAME_FP 20
+#define FRAME_F 0
+#define FRAME_USER 1
+#define FRAME_RET 11
+#define FRAME_PAD 0
+
+/* A new context starts with the rounding mode and traps of the one that
+ * made it. */
+static void *fp_state(void)
+{
+	uint64_t fpcr;
+	__asm__("mrs %0, fpcr" : "=r"(fpcr));
+	return (void *)(uintptr_t)fpcr;
+}
+
+#endif
+
+const char *const makejmp_implementation = "asm";
+
+/* The jmp_buf only holds the stack pointer of the context. */
+static void **sp_of(jmp_buf context)
+{
+	return (void **)context;
+}
+
+void makejmp(
+		jmp_buf new_context,
+		void *stack,
+		unsigned stack_sz,
+		void (*f)(void *user),
+		void *user)
+{
+	uintptr_t top = ((uintptr_t)stack + stack_sz) & ~(uintptr_t)15;
+	void **frame = (void **)top - FRAME_WORDS - FRAME_PAD;
+	memset(frame, 0, FRAME_WORDS * sizeof *frame);
+	frame[FRAME_FP] = fp_state();
+	frame[FRAME_F] = (void *)f;
+	frame[FRAME_USER] = user;
+	frame[FRAME_RET] = makejmp_start;
+	*sp_of(new_context) = frame;
+}
+
+void swapjmp(jmp_buf from, jmp_buf to)
+{
+	makejmp_switch(sp_of(from), *sp_of(to));
+}
+
+#else
+
+#include <ucontext.h>
+
+const char *const makejmp_implementation = "setjmp";
+
 struct data {
 	ucontext_t new, old;
 	jmp_buf *buf;
@@ -42,6 +227,8 @@ void swapjmp(jmp_buf from, jmp_buf to)
 	if(!setjmp(from)) longjmp(to, 1);
 }
 
+#endif
+
 void copyjmp(jmp_buf dst, jmp_buf src)
 {
 	jmp_buf *dst1 = (jmp_buf *)dst, *src1 = (jmp_buf *)src;
@@ -7,3 +7,6 @@ void makejmp(
 		void *user);
 void swapjmp(jmp_buf from, jmp_buf to);
 void copyjmp(jmp_buf dst, jmp_buf src);
+
+/* "asm" or "setjmp". */
+extern const char *const makejmp_implementation;
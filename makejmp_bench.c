@@ -0,0 +1,56 @@
+/* Measures makejmp() and swapjmp(). Built and run by bench.sh. */
+#include "makejmp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define STACK 4096
+#define SWITCHES 10000000
+#define CREATIONS 1000000
+
+static jmp_buf main_context, co_context;
+
+static unsigned long long clock_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void co(void *user)
+{
+	unsigned long long *n = user;
+	while(1) {
+		++*n;
+		swapjmp(co_context, main_context);
+	}
+}
+
+int main(void)
+{
+	static unsigned char stack[STACK];
+	unsigned long long n = 0;
+	unsigned i;
+
+	unsigned long long start = clock_nsec();
+	for(i = 0; i < CREATIONS; ++i) {
+		makejmp(co_context, stack, STACK, co, &n);
+	}
+	unsigned long long create_nsec = clock_nsec() - start;
+
+	start = clock_nsec();
+	for(i = 0; i < SWITCHES; ++i) swapjmp(main_context, co_context);
+	unsigned long long switch_nsec = clock_nsec() - start;
+
+	if(n != SWITCHES) {
+		fprintf(stderr, "Coroutine ran %llu times.\n", n);
+		return 1;
+	}
+
+	/* Each iteration switches there and back. */
+	printf("%-6s  %6.1f ns per switch  %6.1f ns per creation\n",
+			makejmp_implementation,
+			(double)switch_nsec / SWITCHES / 2,
+			(double)create_nsec / CREATIONS);
+	return 0;
+}
@@ -28,6 +28,17 @@ void player_get_tile(
 		unsigned *bg_out,
 		unsigned *fg_out);
 
+/* Counts the calls made to the partial_update and refresh_screen
+ * callbacks of all players. Callbacks that see the same number are handling
+ * the same change. */
+unsigned long long player_get_frame(struct player *p);
+/* Coordinates of the tiles that look different to other players. Returns
+ * how many, at most max. */
+unsigned player_get_private_tiles(
+		struct player *p,
+		unsigned *coords,
+		unsigned max);
+
 void player_key(struct player *p, unsigned char ch);
 void player_left(struct player *p);
 void player_right(struct player *p);
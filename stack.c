@@ -0,0 +1,146 @@
+#include "stack.h"
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/* Usable size of a stack. Rounded up to whole pages. The coroutines only
+ * parse input and encode updates; the game and stdio run on the main
+ * stack. The deepest use seen is under 5 KiB, so this leaves room for
+ * other compilers and libcs. */
+#ifndef STACK_SIZE
+#define STACK_SIZE 8192
+#endif
+
+/* Released stacks beyond this are unmapped. */
+#define POOL_MAX 1024
+
+/* Unused stack bytes have this value. New mappings already have it, so a
+ * page is only committed once a coroutine reaches it. Zeros written at
+ * the very bottom of the used part are not counted. */
+#define PAINT 0
+
+/* Pooled stacks are linked through their top word, which is in a page that
+ * has been used anyway. */
+struct pooled {
+	void *next;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static void *pool;
+static struct stack_stats stats;
+
+static size_t page_size(void)
+{
+	static size_t sz;
+	if(!sz) sz = sysconf(_SC_PAGESIZE);
+	return sz;
+}
+
+static size_t mapped_size(void)
+{
+	size_t page = page_size();
+	return (STACK_SIZE + page - 1) / page * page;
+}
+
+unsigned stack_size(void)
+{
+	return mapped_size();
+}
+
+static struct pooled *link_of(void *stack)
+{
+	return (struct pooled *)((unsigned char *)stack + mapped_size()) - 1;
+}
+
+static void *map_stack(void)
+{
+	size_t page = page_size();
+	unsigned char *p = mmap(NULL, page + mapped_size(),
+			PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(p == MAP_FAILED) return NULL;
+
+	/* Guard page at the bottom, stacks grow down. */
+	if(mprotect(p, page, PROT_NONE) < 0) {
+		munmap(p, page + mapped_size());
+		return NULL;
+	}
+	return p + page;
+}
+
+static void unmap_stack(void *stack)
+{
+	munmap((unsigned char *)stack - page_size(),
+			page_size() + mapped_size());
+}
+
+void *stack_alloc(void)
+{
+	void *stack = NULL;
+
+	pthread_mutex_lock(&lock);
+	if(pool) {
+		stack = pool;
+		struct pooled *p = link_of(stack);
+		pool = p->next;
+		--stats.pooled;
+		/* The link was the only thing written while pooled. */
+		memset(p, PAINT, sizeof *p);
+	}
+	pthread_mutex_unlock(&lock);
+
+	if(!stack) stack = map_stack();
+	if(!stack) return NULL;
+
+	pthread_mutex_lock(&lock);
+	++stats.in_use;
+	pthread_mutex_unlock(&lock);
+	return stack;
+}
+
+void stack_release(void *stack)
+{
+	/* Find the deepest byte that is not paint. */
+	unsigned char *bytes = stack;
+	size_t sz = mapped_size(), i;
+	for(i = 0; i < sz && bytes[i] == PAINT; ++i);
+	unsigned depth = sz - i;
+
+	/* Repaint what was used so the next user is measured too. */
+	memset(bytes + i, PAINT, depth);
+
+	pthread_mutex_lock(&lock);
+	--stats.in_use;
+	if(depth > stats.max_depth) stats.max_depth = depth;
+	if(stats.pooled < POOL_MAX) {
+		link_of(stack)->next = pool;
+		pool = stack;
+		++stats.pooled;
+		stack = NULL;
+	}
+	pthread_mutex_unlock(&lock);
+
+	if(stack) unmap_stack(stack);
+}
+
+void stack_get_stats(struct stack_stats *stats_out)
+{
+	pthread_mutex_lock(&lock);
+	*stats_out = stats;
+	pthread_mutex_unlock(&lock);
+	stats_out->size = mapped_size();
+}
+
+void stack_drain_pool(void)
+{
+	pthread_mutex_lock(&lock);
+	while(pool) {
+		void *stack = pool;
+		pool = link_of(stack)->next;
+		--stats.pooled;
+		unmap_stack(stack);
+	}
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,23 @@
+/*
+ * Stacks for coroutines. Each stack is mapped with a guard page below it
+ * so an overflow faults instead of corrupting memory. Released stacks are
+ * kept for reuse. The deepest use is measured from what has been written.
+ */
+
+struct stack_stats {
+	unsigned size;
+	unsigned in_use, pooled;
+	/* Most bytes ever used of a released stack. */
+	unsigned max_depth;
+};
+
+/* Usable bytes of each stack. */
+unsigned stack_size(void);
+
+/* The lowest usable address, or NULL. Thread safe. */
+void *stack_alloc(void);
+void stack_release(void *stack);
+
+void stack_get_stats(struct stack_stats *stats);
+/* Unmap the pooled stacks. */
+void stack_drain_pool(void);
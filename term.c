@@ -0,0 +1,150 @@
+#include "term.h"
+#include <limits.h>
+
+/* Two digits for each number below 100. */
+static const char pairs[] =
+	"00010203040506070809101112131415161718192021222324"
+	"25262728293031323334353637383940414243444546474849"
+	"50515253545556575859606162636465666768697071727374"
+	"75767778798081828384858687888990919293949596979899";
+
+static unsigned put_number(char *out, unsigned n)
+{
+	if(n < 10) {
+		out[0] = '0' + n;
+		return 1;
+	}
+	if(n < 100) {
+		out[0] = pairs[2 * n];
+		out[1] = pairs[2 * n + 1];
+		return 2;
+	}
+	if(n < 1000) {
+		out[0] = '0' + n / 100;
+		out[1] = pairs[2 * (n % 100)];
+		out[2] = pairs[2 * (n % 100) + 1];
+		return 3;
+	}
+	unsigned len = put_number(out, n / 100);
+	out[len] = pairs[2 * (n % 100)];
+	out[len + 1] = pairs[2 * (n % 100) + 1];
+	return len + 2;
+}
+
+unsigned term_cup(char *out, unsigned x, unsigned y)
+{
+	unsigned len = 0;
+	out[len++] = 27;
+	out[len++] = '[';
+	len += put_number(out + len, y + 1);
+	out[len++] = ';';
+	len += put_number(out + len, x + 1);
+	out[len++] = 'H';
+	return len;
+}
+
+static unsigned number_len(unsigned n)
+{
+	unsigned len = 1;
+	while(n >= 10) {
+		n /= 10;
+		++len;
+	}
+	return len;
+}
+
+/* ESC [ n final, where n is left out if it is 1. */
+static unsigned relative_len(unsigned n)
+{
+	if(!n) return 0;
+	return n == 1 ? 3 : 3 + number_len(n);
+}
+
+static unsigned put_relative(char *out, unsigned n, char final)
+{
+	if(!n) return 0;
+	unsigned len = 0;
+	out[len++] = 27;
+	out[len++] = '[';
+	if(n != 1) len += put_number(out + len, n);
+	out[len++] = final;
+	return len;
+}
+
+unsigned term_move(char *out, unsigned from_x, unsigned from_y, unsigned x,
+		unsigned y)
+{
+	unsigned cup = 4 + number_len(y + 1) + number_len(x + 1);
+
+	/* Up or down, then left or right. Backspace is a byte per column. */
+	unsigned vertical = relative_len(y > from_y ? y - from_y : from_y - y);
+	unsigned left = x < from_x ? from_x - x : 0;
+	unsigned use_bs = left && left <= relative_len(left);
+	unsigned horizontal = use_bs ? left :
+		relative_len(x > from_x ? x - from_x : left);
+	unsigned relative = vertical + horizontal;
+
+	/* CR LF, a LF per extra line and then right. A bare LF might also
+	 * return the carriage on the client, so it only follows a CR. */
+	unsigned crlf = y > from_y ? 1 + (y - from_y) + relative_len(x) :
+		UINT_MAX;
+
+	unsigned len = 0;
+	if(cup <= relative && cup <= crlf) {
+		len = term_cup(out, x, y);
+	}
+	else if(relative <= crlf) {
+		if(y < from_y) len += put_relative(out, from_y - y, 'A');
+		else len += put_relative(out, y - from_y, 'B');
+		if(use_bs) {
+			while(len < vertical + left) out[len++] = 8;
+		}
+		else if(x > from_x) {
+			len += put_relative(out + len, x - from_x, 'C');
+		}
+		else {
+			len += put_relative(out + len, left, 'D');
+		}
+	}
+	else {
+		out[len++] = 13;
+		while(from_y++ < y) out[len++] = 10;
+		len += put_relative(out + len, x, 'C');
+	}
+	return len;
+}
+
+unsigned term_sgr(char *out, unsigned fg, unsigned bg, unsigned old_fg,
+		unsigned old_bg)
+{
+	if(fg == old_fg && bg == old_bg) return 0;
+
+	unsigned len = 0;
+	out[len++] = 27;
+	out[len++] = '[';
+	if(fg != old_fg) {
+		out[len++] = '3';
+		out[len++] = '0' + fg;
+	}
+	if(fg != old_fg && bg != old_bg) out[len++] = ';';
+	if(bg != old_bg) {
+		out[len++] = '4';
+		out[len++] = '0' + bg;
+	}
+	out[len++] = 'm';
+	return len;
+}
+
+unsigned term_ed(char *out)
+{
+	out[0] = 27;
+	out[1] = '[';
+	out[2] = '2';
+	out[3] = 'J';
+	return 4;
+}
+
+unsigned term_rep(char *out, unsigned n)
+{
+	return put_relative(out, n, 'b');
+}
@@ -0,0 +1,31 @@
+/*
+ * Encoder for the escape sequences sent to clients. Writes into a caller
+ * supplied buffer and returns the number of bytes written.
+ */
+
+/* Most bytes written by the functions below for coordinates, counts and
+ * colors that fit in three digits. */
+#define TERM_CUP_MAX 10
+#define TERM_SGR_MAX 8
+#define TERM_ED_MAX 4
+#define TERM_REP_MAX 6
+
+/* Fewest repeats for which term_rep() is shorter than writing the
+ * character again. */
+#define TERM_REP_MIN 5
+
+/* Move the cursor to the zero based x, y. */
+unsigned term_cup(char *out, unsigned x, unsigned y);
+/* Move the cursor from from_x, from_y to x, y with whatever is shortest
+ * of an absolute move, relative moves, backspaces or a carriage return
+ * and line feeds. Never writes more than term_cup() would. */
+unsigned term_move(char *out, unsigned from_x, unsigned from_y, unsigned x,
+		unsigned y);
+/* Change colors from old_fg, old_bg to fg, bg, which are 0 to 7. Writes
+ * nothing if they are the same. */
+unsigned term_sgr(char *out, unsigned fg, unsigned bg, unsigned old_fg,
+		unsigned old_bg);
+/* Clear the whole screen with the current background color. */
+unsigned term_ed(char *out);
+/* Repeat the last character written n times. */
+unsigned term_rep(char *out, unsigned n);
@@ -0,0 +1,84 @@
+/* Compares the bytes term_move() and term_cup() spend on cursor movement
+ * for the kinds of updates the game sends. Built and run by bench.sh. */
+#include "term.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define W 80
+#define H 24
+#define UPDATES 100000
+
+struct pattern {
+	const char *name;
+	/* Fills coords with up to 16 cells and returns how many. */
+	unsigned (*cells)(unsigned *coords);
+};
+
+/* A player or boulder moving one step. */
+static unsigned step(unsigned *coords)
+{
+	unsigned x = 1 + rand() % (W - 2), y = 1 + rand() % (H - 2);
+	unsigned dir = rand() % 4;
+	coords[0] = x;
+	coords[1] = y;
+	coords[2] = x + (dir == 0) - (dir == 1);
+	coords[3] = y + (dir == 2) - (dir == 3);
+	return 2;
+}
+
+/* Several steps at once, in the order they were made. */
+static unsigned steps(unsigned *coords)
+{
+	unsigned n = 1 + rand() % 8, i;
+	for(i = 0; i < n; ++i) step(coords + 4 * i);
+	return 2 * n;
+}
+
+/* A line of text, such as the player status. */
+static unsigned line(unsigned *coords)
+{
+	unsigned x = rand() % (W - 16), y = rand() % H, i;
+	for(i = 0; i < 16; ++i) {
+		coords[2 * i] = x + i;
+		coords[2 * i + 1] = y;
+	}
+	return 16;
+}
+
+static struct pattern patterns[] = {
+	{"step", step},
+	{"steps", steps},
+	{"line", line},
+};
+
+int main(void)
+{
+	unsigned i, j, k;
+	for(i = 0; i < sizeof patterns / sizeof *patterns; ++i) {
+		unsigned long long cup = 0, move = 0;
+		unsigned cursor_x = 0, cursor_y = 0;
+		char out[TERM_CUP_MAX];
+		srand(1);
+		for(j = 0; j < UPDATES; ++j) {
+			unsigned coords[32];
+			unsigned n = patterns[i].cells(coords);
+			for(k = 0; k < n; ++k) {
+				unsigned x = coords[2 * k], y = coords[2 * k + 1];
+				if(x == cursor_x && y == cursor_y) {
+					++cursor_x;
+					continue;
+				}
+				cup += term_cup(out, x, y);
+				move += term_move(out, cursor_x, cursor_y, x, y);
+				cursor_x = x + 1;
+				cursor_y = y;
+			}
+		}
+		printf("%-6s %8.2f bytes per update with absolute moves, "
+				"%8.2f with the cheapest (%.0f%% saved)\n",
+				patterns[i].name, (double)cup / UPDATES,
+				(double)move / UPDATES,
+				100.0 - 100.0 * move / cup);
+	}
+	return 0;
+}
@@ -0,0 +1,6 @@
+# Run the checks in connection_test.c.
+set -e
+cc $CFLAGS -g -Wfatal-errors -Werror connection_test.c term.c makejmp.c \
+	stack.c -o connection_test
+./connection_test
+rm connection_test
@@ -0,0 +1,7 @@
+/*
+ * Level characters that both the level pack and the game need to know.
+ */
+
+/* Key i opens door i. */
+static const char tile_keys[] = "abcdefghijklmnopqrstuwxyz";
+static const char tile_doors[] = "ABCDEFGHIJKLMNOPQRSTUWXYZ";
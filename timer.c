@@ -0,0 +1,224 @@
+#include "timer.h"
+#include <stdlib.h>
+#include <time.h>
+
+/* Resolution of the wheel. */
+#define TICK_NSEC 1000000ULL
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+
+/* Timers further away than this are parked in the last level until they
+ * come within range. */
+#define MAX_DELTA ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+struct timer {
+	/* In a slot of the wheel if armed. */
+	struct timer **prev_p, *next;
+	unsigned armed;
+
+	/* In ticks. */
+	unsigned long long expires, interval;
+
+	void (*callback)(void *user1);
+	void *user1;
+};
+
+struct timers {
+	/* The tick that will be run next. */
+	unsigned long long now;
+	unsigned long long base_nsec;
+
+	unsigned n_armed;
+	struct timer *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
+static unsigned long long clock_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long current_tick(struct timers *t)
+{
+	return (clock_nsec() - t->base_nsec) / TICK_NSEC;
+}
+
+static int timers(struct timers *t, struct timers **t_out)
+{
+	if(t) goto free;
+
+	t = malloc(sizeof *t);
+	if(!t) goto e_malloc;
+
+	t->now = 0;
+	t->base_nsec = clock_nsec();
+	t->n_armed = 0;
+
+	unsigned i, j;
+	for(i = 0; i < WHEEL_LEVELS; ++i) {
+		for(j = 0; j < WHEEL_SIZE; ++j) t->wheel[i][j] = NULL;
+	}
+
+	*t_out = t;
+	return 0;
+
+free:
+	/* Timers are owned by whoever added them. */
+	free(t);
+e_malloc:
+	return -1;
+}
+
+int timers_new(struct timers **t_out)
+{
+	return timers(NULL, t_out);
+}
+
+void timers_free(struct timers *t)
+{
+	if(t) timers(t, NULL);
+}
+
+static void link_timer(struct timers *t, struct timer *timer)
+{
+	unsigned long long expires = timer->expires;
+	if(expires < t->now) expires = t->now;
+	unsigned long long delta = expires - t->now;
+	if(delta > MAX_DELTA) {
+		delta = MAX_DELTA;
+		expires = t->now + delta;
+	}
+
+	unsigned level = 0;
+	while(delta >> (WHEEL_BITS * (level + 1))) ++level;
+
+	struct timer **slot = &t->wheel[level]
+		[(expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+	timer->prev_p = slot;
+	timer->next = *slot;
+	if(timer->next) timer->next->prev_p = &timer->next;
+	*slot = timer;
+}
+
+static void unlink_timer(struct timer *timer)
+{
+	*timer->prev_p = timer->next;
+	if(timer->next) timer->next->prev_p = timer->prev_p;
+}
+
+struct timer *timers_add(
+		struct timers *t,
+		void (*callback)(void *user1),
+		void *user1)
+{
+	struct timer *timer = malloc(sizeof *timer);
+	if(!timer) return NULL;
+	timer->armed = 0;
+	timer->callback = callback;
+	timer->user1 = user1;
+	return timer;
+}
+
+static void disarm(struct timers *t, struct timer *timer)
+{
+	if(!timer->armed) return;
+	unlink_timer(timer);
+	timer->armed = 0;
+	--t->n_armed;
+}
+
+void timers_set(
+		struct timers *t,
+		struct timer *timer,
+		unsigned long long value_nsec,
+		unsigned long long interval_nsec)
+{
+	disarm(t, timer);
+	if(!value_nsec) return;
+
+	/* Bring the wheel up to date so the expiry is relative to now. */
+	if(!t->n_armed) t->now = current_tick(t);
+
+	/* Round up so that timers never fire early. */
+	timer->expires = current_tick(t) +
+		(value_nsec + TICK_NSEC - 1) / TICK_NSEC;
+	timer->interval = (interval_nsec + TICK_NSEC - 1) / TICK_NSEC;
+	timer->armed = 1;
+	++t->n_armed;
+	link_timer(t, timer);
+}
+
+void timers_remove(struct timers *t, struct timer *timer)
+{
+	disarm(t, timer);
+	free(timer);
+}
+
+int timers_timeout(struct timers *t)
+{
+	if(!t->n_armed) return -1;
+
+	unsigned long long now = current_tick(t);
+	if(now >= t->now) return 0;
+
+	/* The first non-empty slot in the lowest level, or the next time
+	 * the higher levels cascade. */
+	unsigned long long tick = t->now;
+	do {
+		if(t->wheel[0][tick & WHEEL_MASK]) break;
+		++tick;
+	} while(tick & WHEEL_MASK);
+
+	return (tick - now) * TICK_NSEC / 1000000;
+}
+
+/* Move the timers in one slot of a higher level down. */
+static unsigned cascade(struct timers *t, unsigned level)
+{
+	unsigned i = (t->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	struct timer *timer = t->wheel[level][i];
+	t->wheel[level][i] = NULL;
+	while(timer) {
+		struct timer *next = timer->next;
+		link_timer(t, timer);
+		timer = next;
+	}
+	return i;
+}
+
+void timers_run(struct timers *t)
+{
+	unsigned long long now = current_tick(t);
+	while(t->now <= now) {
+		if(!t->n_armed) {
+			t->now = now + 1;
+			break;
+		}
+
+		unsigned level = 1;
+		if(!(t->now & WHEEL_MASK)) {
+			while(level < WHEEL_LEVELS && !cascade(t, level)) ++level;
+		}
+
+		/* Callbacks may add timers to this slot. */
+		struct timer **slot = &t->wheel[0][t->now & WHEEL_MASK];
+		while(*slot) {
+			struct timer *timer = *slot;
+			disarm(t, timer);
+			if(timer->interval) {
+				/* Rearm first since the callback may remove
+				 * the timer. */
+				timer->expires += timer->interval;
+				timer->armed = 1;
+				++t->n_armed;
+				link_timer(t, timer);
+			}
+			timer->callback(timer->user1);
+		}
+		++t->now;
+	}
+}
@@ -0,0 +1,31 @@
+/*
+ * Hierarchical timer wheel. Driven by the event loop through the timeout
+ * of its wait, so timers cost no fds.
+ */
+
+struct timers;
+struct timer;
+
+int timers_new(struct timers **t_out);
+void timers_free(struct timers *t);
+
+/* The timer starts disarmed. */
+struct timer *timers_add(
+		struct timers *t,
+		void (*callback)(void *user1),
+		void *user1);
+/* Like timerfd_settime(): first expiration after value_nsec, then every
+ * interval_nsec if it is not 0. value_nsec == 0 disarms. The callback is
+ * called once per expiration. */
+void timers_set(
+		struct timers *t,
+		struct timer *timer,
+		unsigned long long value_nsec,
+		unsigned long long interval_nsec);
+/* Safe to call from any timer callback, including the timer's own. */
+void timers_remove(struct timers *t, struct timer *timer);
+
+/* Milliseconds until the event loop must call timers_run(), or -1. */
+int timers_timeout(struct timers *t);
+/* Call the callbacks of all expired timers. */
+void timers_run(struct timers *t);
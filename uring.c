@@ -0,0 +1,812 @@
+#include "uring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/io_uring.h>
+
+/* Buffers the kernel picks from for multishot recv. A power of two. */
+#define BUF_COUNT 64
+#define BUF_SIZE 1024
+#define BUF_GROUP 0
+
+/* Completions queued on one fd before its accept or recv is stopped
+ * until the user has taken them. */
+#define MAX_PENDING 8
+
+/* The low bit of user_data tells the two requests of an fd apart. */
+#define REQ_POLL 0
+#define REQ_DATA 1
+
+struct uring_fd {
+	int fd;
+	/* Poll mask, 0 if no poll is needed. */
+	unsigned events;
+
+	/* Edge triggered fds use one multishot poll, the others are polled
+	 * again after each event which gives level triggered behaviour. */
+	unsigned multishot;
+
+	/* Listening sockets get a multishot accept and sockets read through
+	 * uring_recv() a multishot recv. Their results wait in pending. */
+	enum {
+		DATA_NONE,
+		DATA_ACCEPT,
+		DATA_RECV,
+	} data;
+
+	/* Are the requests in flight? */
+	unsigned poll_armed, data_armed;
+
+	/* The recv ended because all buffers were taken. It is armed again
+	 * when one is returned. */
+	unsigned starved;
+	/* The accept or recv was cancelled because pending filled up. It is
+	 * armed again when the user has taken everything. */
+	unsigned throttled;
+	unsigned eof;
+	int error;
+
+	/* Accepted fds, or ids and lengths of received buffers, oldest
+	 * first. pending_off bytes of the first buffer have been read.
+	 * Completions that were on their way when the request was cancelled
+	 * can take it past MAX_PENDING. */
+	struct pending {
+		int value;
+		unsigned len;
+	} *pending;
+	unsigned n_pending, pending_sz, pending_off;
+
+	/* NULL once removed. The struct is freed when the kernel no longer
+	 * refers to it. */
+	int (*callback)(void *user1, unsigned revents);
+	void *user1;
+
+	/* In uring.fds. */
+	struct uring_fd **prev_p, *next;
+	struct uring_fd *next_dead;
+};
+
+struct uring {
+	int fd;
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_sz, cq_ring_sz;
+	struct io_uring_sqe *sqes;
+	size_t sqes_sz;
+
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_entries, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	unsigned to_submit;
+
+	/* Provided buffer ring for BUF_GROUP and the memory behind it. */
+	struct io_uring_buf_ring *br;
+	size_t br_sz;
+	unsigned char *bufs;
+	unsigned short br_tail;
+	/* Buffers queued in pending that the kernel cannot use. */
+	unsigned n_held;
+	unsigned n_starved;
+
+	/* All structs that have not been freed yet. */
+	struct uring_fd *fds;
+
+	/* Removed while nothing was armed. Freed after the current batch. */
+	struct uring_fd *dead;
+
+	unsigned long long syscalls, events;
+};
+
+static int enter(struct uring *u, unsigned to_submit, unsigned min_complete,
+		unsigned flags, int timeout)
+{
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof arg);
+	if(timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = timeout % 1000 * 1000000LL;
+		arg.ts = (unsigned long long)(uintptr_t)&ts;
+	}
+
+	++u->syscalls;
+	int status = syscall(__NR_io_uring_enter, u->fd, to_submit,
+			min_complete, flags | IORING_ENTER_EXT_ARG, &arg,
+			sizeof arg);
+	if(status < 0 && (errno == ETIME || errno == EINTR)) return 0;
+	if(status < 0) return -1;
+	u->to_submit -= status < u->to_submit ? status : u->to_submit;
+	return 0;
+}
+
+static int probe(struct uring *u);
+static void drain(struct uring *u);
+static void recycle(struct uring *u, unsigned bid);
+
+static void free_fd(struct uring_fd *f)
+{
+	*f->prev_p = f->next;
+	if(f->next) f->next->prev_p = f->prev_p;
+	free(f->pending);
+	free(f);
+}
+
+static void free_dead(struct uring *u)
+{
+	while(u->dead) {
+		struct uring_fd *f = u->dead;
+		u->dead = f->next_dead;
+		free_fd(f);
+	}
+}
+
+static int uring(
+		struct uring *u,
+		struct uring **u_out,
+		unsigned entries)
+{
+	if(u) goto free;
+
+	u = malloc(sizeof *u);
+	if(!u) goto e_malloc;
+
+	u->to_submit = 0;
+	u->br_tail = 0;
+	u->n_held = 0;
+	u->n_starved = 0;
+	u->fds = NULL;
+	u->dead = NULL;
+	u->syscalls = 0;
+	u->events = 0;
+
+	/* The buffers go after the ring, so that nothing the kernel still
+	 * has armed can write to them. */
+	u->br_sz = BUF_COUNT * sizeof(struct io_uring_buf);
+	u->br = mmap(NULL, u->br_sz, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(u->br == MAP_FAILED) goto e_br;
+
+	u->bufs = malloc(BUF_COUNT * BUF_SIZE);
+	if(!u->bufs) goto e_bufs;
+
+	struct io_uring_params p;
+	memset(&p, 0, sizeof p);
+	u->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if(u->fd < 0) goto e_setup;
+
+	/* Timeouts are passed to io_uring_enter() as an extended argument,
+	 * and multishot requests can post more completions than the ring
+	 * holds. */
+	if(!(p.features & IORING_FEAT_NODROP) ||
+			!(p.features & IORING_FEAT_EXT_ARG)) {
+		errno = EOPNOTSUPP;
+		goto e_features;
+	}
+
+	u->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->sq_ring = mmap(NULL, u->sq_ring_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if(u->sq_ring == MAP_FAILED) goto e_sq_ring;
+
+	u->cq_ring_sz = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	u->cq_ring = mmap(NULL, u->cq_ring_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+	if(u->cq_ring == MAP_FAILED) goto e_cq_ring;
+
+	u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if(u->sqes == MAP_FAILED) goto e_sqes;
+
+	unsigned char *sq = u->sq_ring, *cq = u->cq_ring;
+	u->sq_head = (unsigned *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_entries = (unsigned *)(sq + p.sq_off.ring_entries);
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+	u->cq_head = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof reg);
+	reg.ring_addr = (unsigned long long)(uintptr_t)u->br;
+	reg.ring_entries = BUF_COUNT;
+	reg.bgid = BUF_GROUP;
+	if(syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING,
+				&reg, 1) < 0) goto e_register;
+
+	unsigned i;
+	for(i = 0; i < BUF_COUNT; ++i) recycle(u, i);
+
+	if(probe(u) < 0) goto e_probe;
+
+	*u_out = u;
+	return 0;
+
+free:
+	drain(u);
+e_probe:
+	memset(&reg, 0, sizeof reg);
+	reg.bgid = BUF_GROUP;
+	syscall(__NR_io_uring_register, u->fd, IORING_UNREGISTER_PBUF_RING,
+			&reg, 1);
+e_register:
+	munmap(u->sqes, u->sqes_sz);
+e_sqes:
+	munmap(u->cq_ring, u->cq_ring_sz);
+e_cq_ring:
+	munmap(u->sq_ring, u->sq_ring_sz);
+e_sq_ring:
+e_features:
+	close(u->fd);
+e_setup:
+	free(u->bufs);
+e_bufs:
+	munmap(u->br, u->br_sz);
+e_br:
+	free(u);
+e_malloc:
+	return -1;
+}
+
+int uring_new(struct uring **u_out, unsigned entries)
+{
+	return uring(NULL, u_out, entries);
+}
+
+void uring_free(struct uring *u)
+{
+	if(u) uring(u, NULL, 0);
+}
+
+static struct io_uring_sqe *get_sqe(struct uring *u)
+{
+	unsigned tail = *u->sq_tail;
+	if(tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) ==
+			*u->sq_entries) {
+		/* Full. Submit what we have without waiting. */
+		if(enter(u, u->to_submit, 0, 0, -1) < 0) return NULL;
+	}
+
+	unsigned i = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[i];
+	memset(sqe, 0, sizeof *sqe);
+	u->sq_array[i] = i;
+	return sqe;
+}
+
+static void put_sqe(struct uring *u)
+{
+	__atomic_store_n(u->sq_tail, *u->sq_tail + 1, __ATOMIC_RELEASE);
+	++u->to_submit;
+}
+
+static unsigned long long req(struct uring_fd *f, unsigned type)
+{
+	return (unsigned long long)(uintptr_t)f | type;
+}
+
+static int arm_poll(struct uring *u, struct uring_fd *f)
+{
+	struct io_uring_sqe *sqe = get_sqe(u);
+	if(!sqe) return -1;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = f->fd;
+	sqe->poll32_events = f->events;
+	sqe->len = f->multishot ? IORING_POLL_ADD_MULTI : 0;
+	sqe->user_data = req(f, REQ_POLL);
+	put_sqe(u);
+	f->poll_armed = 1;
+	return 0;
+}
+
+static void prep_accept(struct io_uring_sqe *sqe, int fd)
+{
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+}
+
+static void prep_recv(struct io_uring_sqe *sqe, int fd)
+{
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BUF_GROUP;
+}
+
+static int arm_data(struct uring *u, struct uring_fd *f)
+{
+	struct io_uring_sqe *sqe = get_sqe(u);
+	if(!sqe) return -1;
+	if(f->data == DATA_ACCEPT) prep_accept(sqe, f->fd);
+	else prep_recv(sqe, f->fd);
+	sqe->user_data = req(f, REQ_DATA);
+	put_sqe(u);
+	f->data_armed = 1;
+	return 0;
+}
+
+static int cancel(struct uring *u, unsigned long long user_data)
+{
+	struct io_uring_sqe *sqe = get_sqe(u);
+	if(!sqe) return -1;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = user_data;
+	/* The completion of the cancellation itself is ignored. */
+	sqe->user_data = 0;
+	put_sqe(u);
+	return 0;
+}
+
+/* Give a buffer back to the kernel. */
+static void recycle(struct uring *u, unsigned bid)
+{
+	struct io_uring_buf *b = &u->br->bufs[u->br_tail & (BUF_COUNT - 1)];
+	b->addr = (unsigned long long)(uintptr_t)(u->bufs + bid * BUF_SIZE);
+	b->len = BUF_SIZE;
+	b->bid = bid;
+	++u->br_tail;
+	__atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+
+	if(!u->n_starved) return;
+	struct uring_fd *f;
+	u->n_starved = 0;
+	for(f = u->fds; f; f = f->next) {
+		if(!f->starved) continue;
+		/* Armed once the user has caught up. */
+		if(f->throttled) f->starved = 0;
+		else if(f->callback && arm_data(u, f) < 0) ++u->n_starved;
+		else f->starved = 0;
+	}
+}
+
+/* Drop what nobody will read. */
+static void release_pending(struct uring *u, struct uring_fd *f)
+{
+	unsigned i;
+	for(i = 0; i < f->n_pending; ++i) {
+		if(f->data == DATA_ACCEPT) close(f->pending[i].value);
+		else {
+			--u->n_held;
+			recycle(u, f->pending[i].value);
+		}
+	}
+	f->n_pending = 0;
+	f->pending_off = 0;
+}
+
+/* Queue a completion for the user. Stops the accept or recv when the
+ * user falls behind. */
+static int push_pending(struct uring *u, struct uring_fd *f, int value,
+		unsigned len)
+{
+	if(f->n_pending == f->pending_sz) {
+		unsigned sz = f->pending_sz ? 2 * f->pending_sz : MAX_PENDING;
+		struct pending *new_pending = realloc(f->pending,
+				sz * sizeof *new_pending);
+		if(!new_pending) return -1;
+		f->pending = new_pending;
+		f->pending_sz = sz;
+	}
+	f->pending[f->n_pending].value = value;
+	f->pending[f->n_pending].len = len;
+	++f->n_pending;
+
+	if(f->n_pending >= MAX_PENDING && !f->throttled) {
+		f->throttled = 1;
+		if(f->data_armed) cancel(u, req(f, REQ_DATA));
+	}
+	return 0;
+}
+
+static void pop_pending(struct uring *u, struct uring_fd *f)
+{
+	--f->n_pending;
+	memmove(f->pending, f->pending + 1, f->n_pending * sizeof *f->pending);
+	f->pending_off = 0;
+
+	/* If the cancellation has not completed yet, completion() arms it
+	 * when it does. */
+	if(f->n_pending || !f->throttled) return;
+	f->throttled = 0;
+	if(f->data_armed || f->eof || f->error) return;
+	if(arm_data(u, f) < 0) {
+		f->starved = 1;
+		++u->n_starved;
+	}
+}
+
+void *uring_add_fd(
+		struct uring *u,
+		int fd,
+		unsigned events,
+		int (*callback)(void *user1, unsigned revents),
+		void *user1)
+{
+	struct uring_fd *f = malloc(sizeof *f);
+	if(!f) return NULL;
+
+	f->fd = fd;
+	f->data = events & 8 ? DATA_ACCEPT : events & 16 ? DATA_RECV :
+		DATA_NONE;
+	/* The accept or recv replaces polling for input. */
+	f->events =
+		((events & 1) && f->data == DATA_NONE ? EPOLLIN : 0) |
+		((events & 2) ? EPOLLOUT : 0);
+	f->multishot = events & 4 ? 1 : 0;
+	f->callback = callback;
+	f->user1 = user1;
+	f->poll_armed = 0;
+	f->data_armed = 0;
+	f->starved = 0;
+	f->throttled = 0;
+	f->eof = 0;
+	f->error = 0;
+	f->pending = NULL;
+	f->n_pending = 0;
+	f->pending_sz = 0;
+	f->pending_off = 0;
+
+	f->prev_p = &u->fds;
+	f->next = u->fds;
+	if(f->next) f->next->prev_p = &f->next;
+	u->fds = f;
+
+	if(f->events && arm_poll(u, f) < 0) goto e_arm;
+	if(f->data != DATA_NONE && arm_data(u, f) < 0) goto e_arm;
+	return f;
+
+e_arm:
+	uring_remove_fd(u, f);
+	return NULL;
+}
+
+void uring_remove_fd(struct uring *u, void *fd_ptr)
+{
+	struct uring_fd *f = fd_ptr;
+	f->callback = NULL;
+	release_pending(u, f);
+	/* Freed when the requests complete. */
+	if(f->poll_armed) cancel(u, req(f, REQ_POLL));
+	if(f->data_armed) cancel(u, req(f, REQ_DATA));
+	if(!f->poll_armed && !f->data_armed) {
+		/* We might be in its callback. */
+		f->next_dead = u->dead;
+		u->dead = f;
+	}
+}
+
+int uring_accept(struct uring *u, void *fd_ptr)
+{
+	struct uring_fd *f = fd_ptr;
+	if(!f->n_pending) {
+		errno = EAGAIN;
+		return -1;
+	}
+	int fd = f->pending[0].value;
+	pop_pending(u, f);
+	return fd;
+}
+
+ssize_t uring_recv(struct uring *u, void *fd_ptr, void *buf, size_t len)
+{
+	struct uring_fd *f = fd_ptr;
+	if(!f->n_pending) {
+		if(f->eof) return 0;
+		errno = f->error ? f->error : EAGAIN;
+		return -1;
+	}
+
+	unsigned bid = f->pending[0].value;
+	size_t n = f->pending[0].len - f->pending_off;
+	if(n > len) n = len;
+	memcpy(buf, u->bufs + bid * BUF_SIZE + f->pending_off, n);
+	f->pending_off += n;
+	if(f->pending_off == f->pending[0].len) {
+		pop_pending(u, f);
+		--u->n_held;
+		recycle(u, bid);
+	}
+	return n;
+}
+
+static unsigned accepted(struct uring *u, struct uring_fd *f, int res)
+{
+	/* Errors like running out of fds end the accept. It is armed again
+	 * and fails again, like a level triggered poll would keep
+	 * reporting the socket. */
+	if(res < 0) return 0;
+	if(!f->callback) {
+		close(res);
+		return 0;
+	}
+	if(push_pending(u, f, res, 0) < 0) {
+		fprintf(stderr, "Dropped a connection: %s\n",
+				strerror(errno));
+		close(res);
+		return 0;
+	}
+	return 1;
+}
+
+static unsigned received(struct uring *u, struct uring_fd *f,
+		struct io_uring_cqe *cqe)
+{
+	if(cqe->flags & IORING_CQE_F_BUFFER) {
+		unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		if(cqe->res > 0 && f->callback && !f->error) {
+			if(push_pending(u, f, bid, cqe->res) == 0) {
+				++u->n_held;
+				return 1;
+			}
+			/* Skipping data would corrupt the stream. The user
+			 * reads what came before, then the error. */
+			recycle(u, bid);
+			f->error = errno;
+			if(f->data_armed) cancel(u, req(f, REQ_DATA));
+			return 1;
+		}
+		recycle(u, bid);
+		if(cqe->res > 0) return 0;
+	}
+	if(!f->callback) return 0;
+	if(cqe->res == 0) {
+		f->eof = 1;
+		return 1;
+	}
+	if(cqe->res == -ENOBUFS) {
+		/* If the buffers are only on their way back, the recv is
+		 * armed again right away. */
+		if(u->n_held == BUF_COUNT) {
+			f->starved = 1;
+			++u->n_starved;
+		}
+		return 0;
+	}
+	if(cqe->res == -ECANCELED) return 0;
+	f->error = -cqe->res;
+	return 1;
+}
+
+static int completion(struct uring *u, struct io_uring_cqe *cqe)
+{
+	unsigned type = cqe->user_data & REQ_DATA;
+	struct uring_fd *f = (void *)(uintptr_t)(cqe->user_data - type);
+	if(!f) return 0;
+
+	unsigned more = cqe->flags & IORING_CQE_F_MORE;
+	unsigned revents = 0;
+	if(type == REQ_POLL) {
+		if(!more) f->poll_armed = 0;
+		/* Completions only carry the events of one wakeup, so a
+		 * missing EPOLLOUT does not mean the fd is not writable.
+		 * Users find that out from EAGAIN. -ECANCELED ends a
+		 * multishot poll. */
+		if(cqe->res < 0 && cqe->res != -ECANCELED) revents = 4;
+		else if(cqe->res > 0) {
+			revents =
+				(cqe->res & EPOLLIN ? 1 : 0) |
+				(cqe->res & EPOLLOUT ? 2 : 0) |
+				(cqe->res & EPOLLERR ? 4 : 0);
+		}
+	}
+	else {
+		if(!more) f->data_armed = 0;
+		if(f->data == DATA_ACCEPT) revents = accepted(u, f, cqe->res);
+		else revents = received(u, f, cqe);
+	}
+
+	if(!f->callback) {
+		if(!f->poll_armed && !f->data_armed) free_fd(f);
+		return 0;
+	}
+
+	if(revents) {
+		++u->events;
+		if(f->callback(f->user1, revents) < 0) return -1;
+	}
+
+	/* Might have been removed by the callback. */
+	if(!f->callback) return 0;
+	if(f->events && !f->poll_armed && arm_poll(u, f) < 0) return -1;
+	if(f->data != DATA_NONE && !f->data_armed && !f->starved &&
+			!f->throttled && !f->eof && !f->error &&
+			arm_data(u, f) < 0) return -1;
+	return 0;
+}
+
+/* user_data of the requests issued by probe(). */
+#define PROBE_POLL 1
+#define PROBE_RECV 2
+#define PROBE_ACCEPT 3
+#define PROBE_ALL (1 << PROBE_POLL | 1 << PROBE_RECV | 1 << PROBE_ACCEPT)
+
+struct probe {
+	/* Bits of the requests in flight and of those that completed and
+	 * stayed armed. */
+	unsigned armed, ok;
+	int error;
+};
+
+/* Dispatch probe completions until no request in mask is in flight
+ * without having completed once. */
+static int probe_reap(struct uring *u, struct probe *p, unsigned mask)
+{
+	unsigned tries = 0;
+	while(p->armed & mask & ~p->ok) {
+		if(tries++ == 10) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		if(enter(u, u->to_submit, 1, IORING_ENTER_GETEVENTS, 100) < 0)
+			return -1;
+
+		unsigned head = *u->cq_head;
+		while(head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe cqe = u->cqes[head & *u->cq_mask];
+			++head;
+			__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+			if(!cqe.user_data || cqe.user_data > PROBE_ACCEPT)
+				continue;
+			unsigned bit = 1 << cqe.user_data;
+			unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+			if(cqe.flags & IORING_CQE_F_BUFFER) recycle(u, bid);
+			if(cqe.user_data == PROBE_ACCEPT && cqe.res >= 0)
+				close(cqe.res);
+			if(!(cqe.flags & IORING_CQE_F_MORE)) p->armed &= ~bit;
+			else if(cqe.res >= 0) p->ok |= bit;
+			if(cqe.res < 0 && cqe.res != -ECANCELED)
+				p->error = -cqe.res;
+		}
+	}
+	return 0;
+}
+
+/* Multishot recv and accept need Linux 6.0, and io_uring may be
+ * restricted. Issue the multishot requests used here on throwaway
+ * sockets and check that each one stays armed after a completion. */
+static int probe(struct uring *u)
+{
+	int status = -1;
+	struct probe p = {PROBE_ALL, 0, 0};
+
+	int sv[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+				sv) < 0) goto e_socketpair;
+
+	/* The kernel picks an abstract address when none is given. */
+	struct sockaddr_un addr;
+	socklen_t addr_len = sizeof addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	int l = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(l < 0) goto e_listen_socket;
+	if(bind(l, (struct sockaddr *)&addr, sizeof addr.sun_family) < 0 ||
+			listen(l, 1) < 0 ||
+			getsockname(l, (struct sockaddr *)&addr, &addr_len) < 0)
+		goto e_listen;
+
+	int c = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(c < 0) goto e_connect_socket;
+	if(connect(c, (struct sockaddr *)&addr, addr_len) < 0 ||
+			write(sv[1], "x", 1) != 1) goto e_connect;
+
+	/* The ring is empty, so get_sqe() cannot fail. */
+	struct io_uring_sqe *sqe = get_sqe(u);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = sv[0];
+	sqe->poll32_events = EPOLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = PROBE_POLL;
+	put_sqe(u);
+
+	sqe = get_sqe(u);
+	prep_recv(sqe, sv[0]);
+	sqe->user_data = PROBE_RECV;
+	put_sqe(u);
+
+	sqe = get_sqe(u);
+	prep_accept(sqe, l);
+	sqe->user_data = PROBE_ACCEPT;
+	put_sqe(u);
+
+	status = probe_reap(u, &p, PROBE_ALL);
+	unsigned ok = p.ok;
+
+	/* Cancel what is still armed and wait for it to go. */
+	unsigned i;
+	for(i = PROBE_POLL; i <= PROBE_ACCEPT; ++i) {
+		if(p.armed & 1 << i && cancel(u, i) < 0) status = -1;
+	}
+	p.ok = 0;
+	if(probe_reap(u, &p, PROBE_ALL) < 0) status = -1;
+
+	if(!status && ok != PROBE_ALL) {
+		status = -1;
+		errno = p.error ? p.error : EOPNOTSUPP;
+	}
+
+	/* Only count what the server does. */
+	u->syscalls = 0;
+
+e_connect:
+	close(c);
+e_connect_socket:
+e_listen:
+	close(l);
+e_listen_socket:
+	close(sv[0]);
+	close(sv[1]);
+e_socketpair:
+	return status;
+}
+
+int uring_wait(struct uring *u, int timeout)
+{
+	if(enter(u, u->to_submit, 1, IORING_ENTER_GETEVENTS, timeout) < 0)
+		return -1;
+
+	unsigned head = *u->cq_head;
+	while(head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe cqe = u->cqes[head & *u->cq_mask];
+		++head;
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+		if(completion(u, &cqe) < 0) return -1;
+	}
+
+	free_dead(u);
+	return 0;
+}
+
+/* Cancel everything and wait for the kernel to let go. Accepted fds and
+ * buffers that arrive meanwhile are closed and recycled. */
+static void drain(struct uring *u)
+{
+	struct uring_fd *f;
+	for(f = u->fds; f; f = f->next) {
+		if(f->callback) uring_remove_fd(u, f);
+	}
+	free_dead(u);
+
+	unsigned tries = 0;
+	while(u->fds && tries++ < 10) {
+		if(enter(u, u->to_submit, 1, IORING_ENTER_GETEVENTS, 100) < 0)
+			break;
+		unsigned head = *u->cq_head;
+		while(head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe cqe = u->cqes[head & *u->cq_mask];
+			++head;
+			__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+			completion(u, &cqe);
+		}
+	}
+
+	/* Closing the ring cancels what did not go away. */
+	while(u->fds) free_fd(u->fds);
+}
+
+void uring_get_stats(
+		struct uring *u,
+		unsigned long long *syscalls_out,
+		unsigned long long *events_out)
+{
+	*syscalls_out = u->syscalls;
+	*events_out = u->events;
+}
@@ -0,0 +1,40 @@
+/*
+ * io_uring event loop. An alternative to the epoll loop in main.c that
+ * queues all fd registrations and waits for readiness in a single
+ * io_uring_enter() per iteration. Listening sockets and sockets that are
+ * read through it get multishot accept and recv requests, so accepting
+ * and reading take no syscalls of their own.
+ */
+
+#include <sys/types.h>
+
+struct uring;
+
+int uring_new(struct uring **u_out, unsigned entries);
+void uring_free(struct uring *u);
+
+/* Same semantics as the add_fd/remove_fd pair used by the other
+ * modules. Events 8 marks a listening socket and 16 a socket read with
+ * uring_recv(); both get event 1 when there is something to take. */
+void *uring_add_fd(
+		struct uring *u,
+		int fd,
+		unsigned events,
+		int (*callback)(void *user1, unsigned revents),
+		void *user1);
+void uring_remove_fd(struct uring *u, void *fd_ptr);
+
+/* Like accept4() with SOCK_NONBLOCK | SOCK_CLOEXEC and read() on the fd,
+ * but return what has already completed. EAGAIN when nothing has. */
+int uring_accept(struct uring *u, void *fd_ptr);
+ssize_t uring_recv(struct uring *u, void *fd_ptr, void *buf, size_t len);
+
+/* Submit queued requests, wait up to timeout milliseconds (-1 for no
+ * limit) for a completion and dispatch all completions that are
+ * ready. */
+int uring_wait(struct uring *u, int timeout);
+
+void uring_get_stats(
+		struct uring *u,
+		unsigned long long *syscalls_out,
+		unsigned long long *events_out);